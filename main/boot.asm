@@ -1,12 +1,41 @@
 ; ========================================
-; BOOT.ASM - Fixed Bootloader
-; Loads kernel at 0x10000 and jumps directly
+; BOOT.ASM - Two-sector Bootloader
+; Sector 1 (boot sector) loads stage 2 from the next STAGE2_SECTORS
+; sectors to 0x7E00. Stage 2 loads the kernel at 0x10000, sized by the
+; kernel's image header, then sets up video, the memory map and
+; protected mode.
 ; No relocation needed
 ; ========================================
 
 [BITS 16]
 [ORG 0x7C00]
 
+; Preferred VBE mode - the deepest linear mode at this resolution wins
+VBE_WIDTH       equ 1024
+VBE_HEIGHT      equ 768
+
+; Boot info block handed to kernel_main (BootInfo in kernel.c)
+BOOT_INFO       equ 0x0500
+BOOT_VBE_MODE   equ BOOT_INFO           ; 0 = no VBE, mode 13h stays
+BOOT_VBE_INFO   equ BOOT_INFO + 4       ; ModeInfoBlock of the chosen mode
+BOOT_PALETTE    equ BOOT_INFO + 0x104   ; 256 x RGB mode 13h DAC palette
+BOOT_E820_COUNT equ BOOT_INFO + 0x404   ; Number of E820 entries
+BOOT_E820_MAP   equ BOOT_INFO + 0x408   ; 24-byte E820 entries
+E820_MAX        equ 32
+BOOT_TSC        equ BOOT_INFO + 0x708   ; 64-bit TSC stamps, see BOOT_TSC_* in kernel.c
+BOOT_TSC_START  equ BOOT_TSC
+BOOT_TSC_LOADED equ BOOT_TSC + 8
+BOOT_TSC_PMODE  equ BOOT_TSC + 16
+BOOT_TSC_UNPACKED equ BOOT_TSC + 24     ; Written by unlz4.asm
+VBE_CTRL_INFO   equ 0x1000              ; Scratch for the VbeInfoBlock
+
+; Stage 2 follows the boot sector, the kernel image follows stage 2
+STAGE2_SECTORS  equ 2
+KERNEL_SEGMENT  equ 0x1000
+KERNEL_LBA      equ 1 + STAGE2_SECTORS
+KERNEL_SIZE     equ 4                   ; Header field: image size in sectors
+KERNEL_MAX_SECTORS equ (0x80000 - 0x10000) / 512   ; Keep clear of the stack
+
 start:
     ; Save boot drive
     mov [boot_drive], dl
@@ -20,6 +49,11 @@ start:
     mov sp, 0x7C00
     sti
     
+    ; Boot timeline: everything before this is firmware
+    rdtsc
+    mov [BOOT_TSC_START], eax
+    mov [BOOT_TSC_START + 4], edx
+    
     ; Set VGA mode 13h
     mov ax, 0x0013
     int 0x10
@@ -28,28 +62,79 @@ start:
     mov si, msg_loading
     call print_string
     
-    ; Load kernel from disk to 0x10000
-    mov ax, 0x1000
-    mov es, ax
-    xor bx, bx
-    
-    mov ah, 0x02        ; Read sectors
-    mov al, 100         ; Read 100 sectors (50KB) - enough for C kernel
-    mov ch, 0           ; Cylinder 0
-    mov cl, 2           ; Start from sector 2
-    mov dh, 0           ; Head 0
+    ; Stage 2 is on track 0 under any geometry, so one CHS read does
+    mov ax, 0x0200 + STAGE2_SECTORS
+    mov cx, 0x0002      ; Cylinder 0, sector 2
+    xor dh, dh          ; Head 0
     mov dl, [boot_drive]
-    
+    mov bx, stage2
     int 0x13
     jc disk_error
+    jmp stage2
+
+disk_error:
+    mov si, msg_error
+    call print_string
+    jmp $
+
+; ========================================
+; PRINT STRING (Real Mode)
+; ========================================
+print_string:
+    pusha
+    mov ah, 0x0E
+.loop:
+    lodsb
+    test al, al
+    jz .done
+    int 0x10
+    jmp .loop
+.done:
+    popa
+    ret
+
+; ========================================
+; BOOT SECTOR DATA
+; ========================================
+boot_drive: db 0
+msg_loading: db 'Loading Bucket OS...', 0x0D, 0x0A, 0
+msg_error: db 'Disk error!', 0x0D, 0x0A, 0
+
+; ========================================
+; BOOT SIGNATURE
+; ========================================
+times 510-($-$$) db 0
+dw 0xAA55
+
+; ========================================
+; STAGE 2 (loaded at 0x7E00)
+; ========================================
+stage2:
+    call load_kernel
+    rdtsc
+    mov [BOOT_TSC_LOADED], eax
+    mov [BOOT_TSC_LOADED + 4], edx
+    xor eax, eax        ; Stays 0 unless the kernel is unpacked
+    mov [BOOT_TSC_UNPACKED], eax
+    mov [BOOT_TSC_UNPACKED + 4], eax
     
     ; Display success
     mov si, msg_success
     call print_string
     
+    ; Switch to a VBE linear framebuffer if one is available
+    call select_vbe_mode
+    
+    ; Hand the BIOS memory map to the kernel's page allocator
+    call collect_e820
+    
     ; Enable A20 line
     call enable_a20
     
+    rdtsc
+    mov [BOOT_TSC_PMODE], eax
+    mov [BOOT_TSC_PMODE + 4], edx
+    
     ; Load GDT
     lgdt [gdt_descriptor]
     
@@ -61,25 +146,207 @@ start:
     ; Far jump to protected mode
     jmp 0x08:protected_mode
 
-disk_error:
-    mov si, msg_error
-    call print_string
-    jmp $
+; ========================================
+; LOAD KERNEL
+; Reads the kernel's first sector, takes the image size from its header
+; and reads the rest. Chunks end on 32 KB boundaries, so no read crosses
+; a 64 KB DMA boundary. INT 13h extensions (LBA) are used when present,
+; otherwise CHS reads, one track at a time, with the drive's geometry.
+; ========================================
+load_kernel:
+    mov ah, 0x41        ; Extensions present?
+    mov bx, 0x55AA
+    mov dl, [boot_drive]
+    int 0x13
+    jc .geometry
+    cmp bx, 0xAA55
+    jne .geometry
+    test cl, 1          ; Packet (AH=42h) interface
+    jz .geometry
+    mov byte [use_lba], 1
+    jmp .read
+    
+.geometry:
+    mov ah, 0x08        ; Drive parameters; keep the floppy defaults on error
+    mov dl, [boot_drive]
+    int 0x13
+    jc .read
+    and cx, 0x3F
+    mov [sectors_per_track], cx
+    movzx ax, dh
+    inc ax
+    mov [heads], ax
+    
+.read:
+    call read_chunk
+    jc disk_error
+    mov ax, [dap_count]
+    add [dap_lba], ax
+    shl ax, 5           ; Sectors to paragraphs
+    add [dap_segment], ax
+    
+    ; Sectors still to read, from the header in the first sector
+    mov ax, KERNEL_SEGMENT
+    mov fs, ax
+    mov cx, [fs:KERNEL_SIZE]
+    cmp cx, KERNEL_MAX_SECTORS
+    ja disk_error
+    add cx, KERNEL_LBA
+    sub cx, [dap_lba]
+    jbe .done
+    
+    ; Up to the next 32 KB boundary
+    mov ax, [dap_segment]
+    shr ax, 5
+    and ax, 63
+    neg ax
+    add ax, 64
+    cmp cx, ax
+    jae .chunk
+    mov ax, cx
+.chunk:
+    mov [dap_count], ax
+    jmp .read
+.done:
+    ret
+
+; Read [dap_count] sectors from [dap_lba] to [dap_segment]:0; CF on error.
+; The CHS path shortens dap_count to the end of the track.
+read_chunk:
+    cmp byte [use_lba], 0
+    je .chs
+    mov si, dap
+    mov ah, 0x42        ; Extended read
+    mov dl, [boot_drive]
+    int 0x13
+    ret
+.chs:
+    mov ax, [dap_lba]
+    xor dx, dx
+    div word [sectors_per_track]    ; AX = track, DX = sector in track
+    mov cx, [sectors_per_track]
+    sub cx, dx
+    cmp cx, [dap_count]
+    jae .track
+    mov [dap_count], cx
+.track:
+    mov cl, dl
+    inc cx              ; Sectors count from 1
+    xor dx, dx
+    div word [heads]    ; AX = cylinder, DX = head
+    mov dh, dl
+    mov ch, al
+    shl ah, 6           ; Cylinder bits 8-9 go in CL bits 6-7
+    or cl, ah
+    les bx, [dap_offset]
+    mov al, [dap_count]
+    mov ah, 0x02        ; Read sectors
+    mov dl, [boot_drive]
+    int 0x13
+    ret
 
 ; ========================================
-; PRINT STRING (Real Mode)
+; SELECT VBE MODE
+; Scans the controller's mode list for a linear framebuffer mode of
+; VBE_WIDTH x VBE_HEIGHT and sets the one with the most bits per pixel.
 ; ========================================
-print_string:
-    pusha
-    mov ah, 0x0E
-.loop:
-    lodsb
-    test al, al
-    jz .done
+select_vbe_mode:
+    xor ax, ax
+    mov es, ax
+    mov [BOOT_VBE_MODE], ax
+    
+    ; Keep the mode 13h palette - direct color modes are drawn with it
+    mov ax, 0x1017      ; Read DAC block
+    xor bx, bx
+    mov cx, 256
+    mov dx, BOOT_PALETTE
     int 0x10
-    jmp .loop
+    
+    mov di, VBE_CTRL_INFO
+    mov dword [di], 'VBE2'
+    mov ax, 0x4F00      ; Controller info
+    int 0x10
+    cmp ax, 0x004F
+    jne .done
+    
+    lfs si, [VBE_CTRL_INFO + 14]    ; Mode list far pointer
+.next:
+    mov cx, [fs:si]
+    add si, 2
+    cmp cx, 0xFFFF
+    je .set
+    
+    mov ax, 0x4F01      ; Mode info
+    mov di, BOOT_VBE_INFO
+    int 0x10
+    cmp ax, 0x004F
+    jne .next
+    
+    mov ax, [di]        ; Supported, graphics, linear framebuffer
+    and ax, 0x0091
+    cmp ax, 0x0091
+    jne .next
+    cmp word [di + 18], VBE_WIDTH
+    jne .next
+    cmp word [di + 20], VBE_HEIGHT
+    jne .next
+    mov al, [di + 27]   ; Packed pixel or direct color only
+    cmp al, 4
+    je .model_ok
+    cmp al, 6
+    jne .next
+.model_ok:
+    mov al, [di + 25]   ; Bits per pixel
+    cmp al, 8
+    jb .next
+    cmp al, [vbe_best_bpp]
+    jbe .next
+    mov [vbe_best_bpp], al
+    mov [BOOT_VBE_MODE], cx
+    jmp .next
+    
+.set:
+    mov cx, [BOOT_VBE_MODE]
+    jcxz .done
+    mov ax, 0x4F01      ; Reload the winner's mode info
+    mov di, BOOT_VBE_INFO
+    int 0x10
+    
+    mov bx, cx
+    or bx, 0x4000       ; Use the linear framebuffer
+    mov ax, 0x4F02      ; Set mode
+    int 0x10
+    cmp ax, 0x004F
+    je .done
+    mov word [BOOT_VBE_MODE], 0
 .done:
-    popa
+    ret
+
+; ========================================
+; COLLECT E820 MEMORY MAP
+; Stores up to E820_MAX entries at BOOT_E820_MAP (ES is 0 here)
+; ========================================
+collect_e820:
+    xor ebx, ebx
+    xor bp, bp
+    mov di, BOOT_E820_MAP
+.next:
+    mov dword [di + 20], 1  ; ACPI 3.0 attributes: valid unless BIOS says otherwise
+    mov eax, 0xE820
+    mov ecx, 24
+    mov edx, 0x534D4150     ; 'SMAP'
+    int 0x15
+    jc .done
+    cmp eax, 0x534D4150
+    jne .done
+    add di, 24
+    inc bp
+    cmp bp, E820_MAX
+    je .done
+    test ebx, ebx
+    jnz .next
+.done:
+    mov [BOOT_E820_COUNT], bp
     ret
 
 ; ========================================
@@ -133,20 +400,26 @@ protected_mode:
     mov ss, ax
     mov esp, 0x90000    ; Stack at 640KB - 64KB
     
-    ; Jump to C kernel (loaded at 0x10000)
+    ; Jump to C kernel (loaded at 0x10000) with the boot info in EBX
     ; The linker script will place _start at the beginning
+    mov ebx, BOOT_INFO
     jmp 0x10000
 
 ; ========================================
 ; DATA
 ; ========================================
-boot_drive: db 0
-msg_loading: db 'Loading Bucket OS...', 0x0D, 0x0A, 0
+
+; INT 13h AH=42h disk address packet, also the CHS read position
+dap:            db 0x10, 0
+dap_count:      dw 1                    ; Header sector first
+dap_offset:     dw 0
+dap_segment:    dw KERNEL_SEGMENT
+dap_lba:        dq KERNEL_LBA
+
+use_lba: db 0
+sectors_per_track: dw 18
+heads: dw 2
+vbe_best_bpp: db 0
 msg_success: db 'Kernel loaded!', 0x0D, 0x0A, 0
-msg_error: db 'Disk error!', 0x0D, 0x0A, 0
 
-; ========================================
-; BOOT SIGNATURE
-; ========================================
-times 510-($-$$) db 0
-dw 0xAA55
\ No newline at end of file
+times 512 * (1 + STAGE2_SECTORS)-($-$$) db 0
\ No newline at end of file
@@ -4,26 +4,156 @@
 // ========================================
 
 #include "types.h"
+#include "memops.h"
 
 // ========================================
 // Hardware Definitions
 // ========================================
 
 #define VGA_MEMORY 0xA0000
-#define SCREEN_WIDTH 320
-#define SCREEN_HEIGHT 200
+#define VGA_WIDTH 320
+#define VGA_HEIGHT 200
+
+// Screen geometry is whatever mode the bootloader left us in
+#define SCREEN_WIDTH (sys->display.fb.width)
+#define SCREEN_HEIGHT (sys->display.fb.height)
 #define SCREEN_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define MAX_SCREEN_WIDTH 1024
+#define MAX_SCREEN_HEIGHT 768
+#define MAX_SCREEN_SIZE (MAX_SCREEN_WIDTH * MAX_SCREEN_HEIGHT)
+
+// Physical memory
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define PMM_MAX_ORDER 10            // Largest buddy block: 4 MB
+#define PMM_FREE 0x80               // page_info: first page of a free block
+#define PMM_LOW_MEMORY 0x100000     // Kernel image, stack and BIOS data below 1 MB
+#define PMM_ADDRESS_LIMIT 0x100000000ULL
+#define E820_USABLE 1
+#define E820_MAX_ENTRIES 32
+
+// Paging: 32-bit two-level tables, identity mapped
+#define PAGE_TABLE_ENTRIES 1024
+#define LARGE_PAGE_SHIFT 22         // 4 MB PSE pages
+#define PTE_PRESENT 0x001
+#define PTE_WRITE 0x002
+#define PTE_PWT 0x008
+#define PDE_LARGE 0x080
+#define PTE_WC PTE_PWT              // Selects PAT entry 1, reprogrammed to WC
+#define CPUID_PSE (1 << 3)
+#define CPUID_PAT (1 << 16)
+#define CR0_PG (1u << 31)
+#define CR4_PSE (1 << 4)
+#define MSR_PAT 0x277
+#define PAT_WC 0x01
+
+// Kernel heap
+#define SLAB_HEADER_SIZE 32         // Slab header at the start of each slab page
+#define SLAB_MAX_OBJECT 512         // Larger kmalloc requests take whole pages
+#define SLAB_PAGE_CACHE_KEEP 8      // Recycled pages a page-sized cache holds on to
+#define EVENT_RING_INITIAL_DEPTH 64
+#define WINDOW_ORDER_INITIAL 8      // First z_order allocation, doubled as needed
+#define FRAME_ARENA_SIZE (256 * 1024)
+#define REGION_INITIAL_RECTS 8
+
+#define TASKBAR_HEIGHT 10
+#define DESKTOP_HEIGHT (SCREEN_HEIGHT - TASKBAR_HEIGHT)
 
 // IO Ports
 #define PIC1_COMMAND 0x20
 #define PIC1_DATA 0x21
 #define PIC2_COMMAND 0xA0
 #define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define PIC_READ_ISR 0x0B
+#define PIC_READ_IRR 0x0A
+#define IRQ_BASE 0x20       // IRQ0-15 remapped to vectors 0x20-0x2F
+#define VGA_SEQ_INDEX 0x3C4
+#define VGA_SEQ_DATA 0x3C5
+#define VGA_GC_INDEX 0x3CE
+#define VGA_GC_DATA 0x3CF
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA 0x3D5
+#define VGA_INPUT_STATUS 0x3DA
+#define VGA_STATUS_RETRACE 0x08
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+#define COM1_PORT 0x3F8
+#define COM1_IRQ 4
+#define UART_IER 1              // Register offsets from the port base
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_SCRATCH 7
+#define UART_IER_THRE 0x02      // Interrupt when the transmit FIFO empties
+#define UART_MCR_OUT2 0x08      // Gates the UART interrupt line on PCs
+#define UART_LSR_THRE 0x20      // Transmit holding register empty
+#define UART_IIR_FIFO 0xC0       // IIR bits 7:6 after enabling FIFOs: 16550A
+#define UART_FIFO_SIZE 16
+
+// Timing
+#define PIT_FREQUENCY 1193182
+#define TIMER_HZ 1000
+#define TIMER_IDLE_HZ 20        // IRQ0 rate while the desktop waits for input
+#define FRAME_HZ 60
+#define VGA_RETRACE_TIMEOUT 20  // Ticks - longer than one 70 Hz refresh
+#define SERIAL_BAUD 115200
+#define SERIAL_TX_SIZE 4096     // Transmit ring, power of two
+
+// Boot timeline: TSC stamps the loader leaves in BootInfo.tsc
+#define BOOT_TSC_START 0        // boot.asm entry, after the firmware
+#define BOOT_TSC_LOADED 1       // Kernel image read
+#define BOOT_TSC_PMODE 2        // Video mode and E820 map done
+#define BOOT_TSC_UNPACKED 3     // unlz4.asm, 0 for an uncompressed kernel
+#define BOOT_TSC_BSS 4          // start.asm, BSS cleared
+#define BOOT_TSC_COUNT 5
+#define BOOT_PHASE_MAX 24
+#define BOOT_CALIBRATION_TICKS 20   // Minimum PIT span for the TSC rate
+#define BOOT_NAME_WIDTH 12          // Columns of a timeline line
+#define BOOT_TIME_WIDTH 10          // Right-aligned; longer times widen the line
+#define BOOT_TIME_MAX 11            // Saturated "4294967.295"
+#define BOOT_LINE_SIZE (BOOT_NAME_WIDTH + BOOT_TIME_MAX + 4)
+#define BOOT_TIMELINE_TITLE "Boot Timeline"
+
+// Frame profiler
+#define PROF_SAMPLES 256                        // Frames of history, power of two
+#define PROF_P99_RANK (PROF_SAMPLES / 100 + 1)  // p99 = this many from the top
+#define PROF_REFRESH_TICKS (TIMER_HZ / 4)       // Overlay redraw period
+#define PROF_REPORT_TICKS TIMER_HZ              // Serial report period
+#define PROF_OVERLAY_TITLE "Performance"
+#define SCANCODE_F12 0x58                       // Toggles the overlay
+
+// Sampling profiler (make DEBUG=1)
+#define SAMPLE_RING_DEPTH 1024                  // EIPs queued between drains
+#define SAMPLE_REPORT_TICKS (10 * TIMER_HZ)
+#define SAMPLE_REPORT_TOP 20
+
+// Mode X page layout: 80 bytes per row in each plane, pages 16 KB apart
+#define MODEX_PITCH (VGA_WIDTH / 4)
+#define MODEX_PAGE_SIZE 0x4000
+
+#define DEFAULT_PRESENT_MODE PRESENT_VSYNC
+
 #define KB_DATA_PORT 0x60
 #define KB_STATUS_PORT 0x64
 #define MOUSE_DATA_PORT 0x60
 #define MOUSE_STATUS_PORT 0x64
 
+// Screen footprint of the 8x8 cursor plus its 1-pixel shadow
+#define CURSOR_EXTENT 9
+
+// Color index that sprites use for see-through pixels (palette 255 is
+// unused black)
+#define SPRITE_KEY 0xFF
+
+// Start menu footprint including its shadow, anchored above the taskbar
+#define START_MENU_X 2
+#define START_MENU_Y (DESKTOP_HEIGHT - 90)
+#define START_MENU_W 82
+#define START_MENU_H 87
+
 // ========================================
 // Data Structures
 // ========================================
@@ -49,22 +179,287 @@ typedef struct {
 } Window;
 
 typedef struct {
-    uint8_t buffer[16];
-    uint8_t head;
-    uint8_t tail;
-} KeyboardBuffer;
+    int16_t dx;
+    int16_t dy;
+    uint8_t buttons;
+} MouseEvent;
+
+// Input rings are filled by IRQ handlers and drained by the main loop.
+// Only the ISR writes tail and only the main loop writes head. The slots
+// live on the kernel heap and the main loop doubles a ring that overflowed.
+typedef struct {
+    uint8_t* slots;
+    uint32_t slot_size;
+    uint32_t mask;              // Depth - 1, depth is a power of two
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    uint32_t dropped_seen;      // 'dropped' when the ring was last sized
+} EventRing;
+
+// COM1 transmit ring. The main loop appends at tail; the THR-empty IRQ
+// or the idle poll sends from head with interrupts off, so the two
+// sides share no lock.
+typedef struct {
+    uint8_t tx[SERIAL_TX_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t dropped;           // Bytes lost to a full ring
+    bool present;               // A UART answered at COM1_PORT
+    uint8_t fifo_size;          // Bytes per THR-empty: 16, or 1 on an 8250/16450
+} SerialPort;
+
+// Stack frame pushed by the CPU on interrupt entry
+typedef struct {
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t eflags;
+} InterruptFrame;
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_high;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) IdtPointer;
+
+// VBE 2.0 ModeInfoBlock as returned by INT 10h AX=4F01h
+typedef struct {
+    uint16_t attributes;
+    uint8_t window_a;
+    uint8_t window_b;
+    uint16_t granularity;
+    uint16_t window_size;
+    uint16_t segment_a;
+    uint16_t segment_b;
+    uint32_t window_func;
+    uint16_t pitch;             // Bytes per scanline
+    uint16_t width;
+    uint16_t height;
+    uint8_t char_width;
+    uint8_t char_height;
+    uint8_t planes;
+    uint8_t bpp;
+    uint8_t banks;
+    uint8_t memory_model;
+    uint8_t bank_size;
+    uint8_t image_pages;
+    uint8_t reserved0;
+    uint8_t red_mask;           // Direct color: channel widths and positions
+    uint8_t red_position;
+    uint8_t green_mask;
+    uint8_t green_position;
+    uint8_t blue_mask;
+    uint8_t blue_position;
+    uint8_t reserved_mask;
+    uint8_t reserved_position;
+    uint8_t direct_color_attributes;
+    uint32_t framebuffer;       // Physical address of the linear framebuffer
+    uint32_t off_screen_offset;
+    uint16_t off_screen_size;
+    uint8_t reserved1[206];
+} __attribute__((packed)) VbeModeInfo;
+
+// BIOS INT 15h AX=E820h memory map entry
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;              // E820_USABLE for RAM
+    uint32_t acpi;              // ACPI 3.0 attributes, bit 0 clear = ignore
+} __attribute__((packed)) E820Entry;
+
+// Handed over by boot.asm (see BOOT_INFO there)
+typedef struct {
+    uint16_t vbe_mode;          // 0 if VBE is unavailable and mode 13h is active
+    uint16_t reserved;
+    VbeModeInfo vbe;
+    uint8_t palette[256][3];    // Mode 13h DAC palette, 6 bits per channel
+    uint16_t e820_count;        // 0 if the BIOS has no E820 support
+    uint16_t reserved2;
+    E820Entry e820[E820_MAX_ENTRIES];
+    uint64_t tsc[BOOT_TSC_COUNT];   // Loader stamps, see BOOT_TSC_*
+} __attribute__((packed)) BootInfo;
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t w;
+    int32_t h;
+} Rect;
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    bool visible;
+    Rect saved;             // Screen area held in save_under
+    uint8_t save_under[CURSOR_EXTENT * CURSOR_EXTENT * 4];  // Surface pixels
+} CursorOverlay;
+
+#define MAX_DIRTY_RECTS 16
+
+// A set of non-overlapping rects, e.g. the visible part of a window. The
+// rects live in the frame arena, so a Region does not outlive the frame.
+typedef struct {
+    Rect* rects;
+    uint32_t count;
+    uint32_t capacity;
+} Region;
+
+// One boot step, ending at a TSC stamp; it starts where the previous
+// one ended (the first at TSC reset)
+typedef struct {
+    const char* name;
+    uint64_t end;
+} BootPhase;
+
+typedef struct {
+    BootPhase phases[BOOT_PHASE_MAX];
+    uint32_t count;
+    uint32_t tsc_khz;           // 0 until calibrated
+    uint32_t calibration_tick;
+    uint64_t calibration_tsc;
+} BootTimeline;
+
+// Main loop phases timed by the frame profiler. The draw phases are
+// summed over every damaged rect the compositor visits in a frame.
+typedef enum {
+    PROF_INPUT,
+    PROF_DESKTOP,           // Includes desktop layer rebuilds (icons)
+    PROF_WINDOWS,
+    PROF_TASKBAR,
+    PROF_START_MENU,
+    PROF_FLUSH,             // Backbuffer to framebuffer, or the page flip
+    PROF_CURSOR,
+    PROF_RENDER,            // All of render_frame
+    PROF_PHASE_COUNT
+} ProfPhase;
+
+typedef struct {
+    uint64_t pending[PROF_PHASE_COUNT];     // Cycles so far this frame
+    uint32_t samples[PROF_PHASE_COUNT][PROF_SAMPLES];   // Cycles per frame
+    uint32_t next;              // Sample slot of the next frame
+    uint32_t count;             // Valid samples per phase
+    uint32_t frames;            // Frames since the last serial report
+    uint32_t report_tick;
+    uint32_t refresh_tick;
+    Window* overlay;            // NULL until first toggled on
+} FrameProfiler;
+
+// One entry of the kernel symbol table the build generates from the
+// linked ELF (ksyms.c, sorted by address). Keep in sync with the
+// Makefile rule that writes it.
+typedef struct {
+    uint32_t addr;
+    const char* name;
+} KernelSymbol;
+
+// One IRQ0 sample. At the idle timer rate a sample stands for several
+// ticks, so it carries its weight.
+typedef struct {
+    uint32_t eip;
+    uint32_t ticks;
+} Sample;
+
+// Timer-driven EIP samples and their per-function counts
+typedef struct {
+    EventRing ring;             // Samples, filled by IRQ0
+    uint32_t* hits;             // Ticks per symbol, the last slot for unknown EIPs
+    uint32_t total;             // Ticks sampled since the last report
+    uint32_t dropped_reported;  // ring.dropped at the last report
+    uint32_t report_tick;
+} SampleProfiler;
+
+// Microseconds over the sample history
+typedef struct {
+    uint32_t min;
+    uint32_t avg;
+    uint32_t p99;
+} ProfStats;
+
+// Linear allocator for data that lives at most one frame
+typedef struct {
+    uint8_t* base;
+    uint32_t size;
+    uint32_t used;
+} FrameArena;
+
+typedef struct {
+    Rect rects[MAX_DIRTY_RECTS];
+    uint32_t count;
+} DamageList;
+
+// Per-format drawing kernels for surfaces, see DEFINE_BLIT_OPS
+typedef struct {
+    uint8_t bytes_per_pixel;
+    void (*fill)(uint8_t* dst, uint32_t pixel, int32_t n);
+    void (*copy)(uint8_t* dst, const uint8_t* src, int32_t n);
+    void (*copy_transparent)(uint8_t* dst, const uint8_t* src, int32_t n);
+    void (*glyph)(uint8_t* dst, int32_t pitch, const uint8_t* glyph, uint32_t pixel);
+    void (*glyph_clipped)(uint8_t* dst, int32_t pitch, const uint8_t* glyph,
+                          int32_t rows, int32_t first, int32_t last, uint32_t pixel);
+} BlitOps;
+
+// Converts n surface pixels to framebuffer pixels
+typedef void (*SpanCopyFn)(uint8_t* dst, const uint8_t* src, int32_t n);
+
+typedef struct {
+    uint8_t* base;              // Linear framebuffer (VGA memory in mode 13h)
+    int32_t width;
+    int32_t height;
+    uint32_t pitch;             // Bytes per scanline
+    uint8_t bytes_per_pixel;
+    SpanCopyFn present_span;    // Specialized for the pixel format
+    uint32_t palette[256];      // Native pixel value of each color index
+} Framebuffer;
+
+typedef enum {
+    PRESENT_IMMEDIATE,      // Copy damage to VGA memory right away
+    PRESENT_VSYNC,          // Copy damage during vertical blanking
+    PRESENT_PAGE_FLIP       // Mode X: draw the hidden page, flip the CRTC
+} PresentMode;
+
+typedef struct {
+    Framebuffer fb;
+    PresentMode mode;
+    uint8_t back_page;              // Page-flip: page not on screen
+    DamageList stale[2];            // Page-flip: rects each page still lacks
+    CursorOverlay cursor[2];        // Cursor state per page ([0] unless flipping)
+} Display;
 
 typedef struct {
     Mouse mouse;
-    KeyboardBuffer keyboard;
-    Window windows[10];
+    EventRing mouse_events;
+    Display display;
+    EventRing keyboard;
+    SerialPort serial;
+    Window** z_order;           // Heap array of windows, bottom to top
     uint32_t window_count;
-    int32_t active_window;
+    uint32_t window_capacity;   // Slots in z_order
+    Window* active_window;      // NULL until a window is clicked
     bool dragging;
     int32_t drag_offset_x;
     int32_t drag_offset_y;
     bool start_menu_open;
-    uint8_t backbuffer[SCREEN_SIZE];
+    bool animation_requested;
+    uint32_t frame_epoch;   // Tick the frame schedule started at
+    uint32_t frame_count;   // Frames since frame_epoch
+    FrameArena frame_arena; // Transient render geometry, reset every pass
+    FrameProfiler profiler;
+    SampleProfiler sampler;
+    DamageList damage;      // Re-render and flush
+    DamageList present;     // Flush only
+    Rect clip;              // Drawing is restricted to this rect
+    uint8_t* target;        // Surface the draw functions render into
+    const BlitOps* blit;    // Kernels for the surfaces' pixel format
+    bool desktop_layer_valid;
+    uint8_t* desktop_layer;     // Same format and pitch as the backbuffer
+    uint8_t* backbuffer;
 } SystemState;
 
 // ========================================
@@ -77,6 +472,8 @@ static uint8_t system_memory[sizeof(SystemState)] __attribute__((aligned(4)));
 // Global hypervisor status
 static bool vtx_supported = false;
 
+static BootTimeline boot_timeline;
+
 // ========================================
 // Inline Assembly Helpers
 // ========================================
@@ -107,24 +504,92 @@ static inline void hlt(void) {
     __asm__ volatile ("hlt");
 }
 
+// cli() that remembers whether interrupts were on, for code that also
+// runs before the IDT is up
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) sti();   // EFLAGS.IF
+}
+
+// Compiler barrier - keeps ring buffer slot accesses ordered around the indices
+static inline void barrier(void) {
+    __asm__ volatile ("" : : : "memory");
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void write_cr3(uint32_t cr3) {
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint64_t tsc;
+    __asm__ volatile ("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+// 64/32 division in two divl steps - there is no libgcc for __udivdi3
+static inline uint64_t udiv64(uint64_t n, uint32_t d) {
+    uint32_t high = (uint32_t)(n >> 32) / d;
+    uint32_t rem = (uint32_t)(n >> 32) % d;
+    uint32_t low;
+    __asm__ ("divl %2" : "=a"(low), "+d"(rem) : "rm"(d), "a"((uint32_t)n));
+    return ((uint64_t)high << 32) | low;
+}
+
+// MSR access functions
+uint64_t read_msr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void write_msr(uint32_t msr, uint64_t value) {
+    uint32_t low = value & 0xFFFFFFFF;
+    uint32_t high = value >> 32;
+    __asm__ volatile ("wrmsr" : : "a"(low), "d"(high), "c"(msr));
+}
+
 // ========================================
 // Memory Operations
 // ========================================
 
+// Small sizes use byte loops, everything else rep stosd/movsd (memops.h)
 void* memset(void* s, int c, size_t n) {
-    uint8_t* p = (uint8_t*)s;
-    while (n--) {
-        *p++ = (uint8_t)c;
-    }
+    mem_fill(s, (uint8_t)c, n);
     return s;
 }
 
 void* memcpy(void* dest, const void* src, size_t n) {
-    uint8_t* d = (uint8_t*)dest;
-    const uint8_t* s = (const uint8_t*)src;
-    while (n--) {
-        *d++ = *s++;
-    }
+    mem_copy(dest, src, n);
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    mem_move(dest, src, n);
     return dest;
 }
 
@@ -147,93 +612,673 @@ int strcmp(const char* s1, const char* s2) {
 }
 
 // ========================================
-// Font Data (8x8)
+// Physical Memory Manager
+// Binary buddy allocator over the usable RAM in the E820 map. Free
+// blocks are kept on one doubly linked list per order, threaded through
+// the free pages themselves (memory is identity mapped), so taking a
+// 4 KB page is a list pop. Blocks of order 9 (2 MB) and up are naturally
+// aligned to their size. page_info holds one byte per page frame: PMM_FREE | order
+// on the first page of each free block, 0 everywhere else.
 // ========================================
 
-// Font Data (8x8)
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+    struct FreeBlock* prev;
+} FreeBlock;
+
+typedef struct {
+    uint8_t* page_info;
+    uint32_t page_count;        // Page frames covered by page_info
+    uint32_t total_pages;       // Usable pages handed to the allocator
+    uint32_t free_pages;
+    FreeBlock* free_list[PMM_MAX_ORDER + 1];
+} PhysicalMemory;
+
+static PhysicalMemory pmm;
+
+// Used when the BIOS gives no E820 map: assume 16 MB of RAM
+static const E820Entry e820_fallback = { 0, 0x1000000, E820_USABLE, 1 };
+
+static inline FreeBlock* pfn_block(uint32_t pfn) {
+    return (FreeBlock*)(pfn << PAGE_SHIFT);
+}
+
+static void pmm_list_push(uint32_t pfn, uint8_t order) {
+    FreeBlock* b = pfn_block(pfn);
+    b->prev = NULL;
+    b->next = pmm.free_list[order];
+    if (b->next) b->next->prev = b;
+    pmm.free_list[order] = b;
+    pmm.page_info[pfn] = PMM_FREE | order;
+}
+
+static void pmm_list_remove(uint32_t pfn, uint8_t order) {
+    FreeBlock* b = pfn_block(pfn);
+    if (b->prev) b->prev->next = b->next;
+    else pmm.free_list[order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pmm.page_info[pfn] = 0;
+}
+
+// Return a block, merging with its buddy for as long as the buddy is a
+// free block of the same order
+static void pmm_free_block(uint32_t pfn, uint8_t order) {
+    pmm.free_pages += 1u << order;
+    
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= pmm.page_count || pmm.page_info[buddy] != (PMM_FREE | order)) break;
+        
+        pmm_list_remove(buddy, order);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    pmm_list_push(pfn, order);
+}
+
+// Free an arbitrary run as the largest aligned blocks that fit
+static void pmm_free_range(uint32_t pfn, uint32_t count) {
+    while (count) {
+        uint8_t order = PMM_MAX_ORDER;
+        while ((pfn & ((1u << order) - 1)) || (1u << order) > count) order--;
+        
+        pmm_free_block(pfn, order);
+        pfn += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+// Smallest free block of at least 'order', split down to size
+static void* pmm_alloc_block(uint8_t order) {
+    uint8_t o = order;
+    while (o <= PMM_MAX_ORDER && !pmm.free_list[o]) o++;
+    if (o > PMM_MAX_ORDER) return NULL;
+    
+    uint32_t pfn = (uint32_t)pmm.free_list[o] >> PAGE_SHIFT;
+    pmm_list_remove(pfn, o);
+    
+    // Keep the lower half, free the upper half at each level
+    while (o > order) {
+        o--;
+        pmm_list_push(pfn + (1u << o), o);
+    }
+    
+    pmm.free_pages -= 1u << order;
+    return pfn_block(pfn);
+}
+
+void* pmm_alloc_page(void) {
+    return pmm_alloc_block(0);
+}
+
+void pmm_free_page(void* page) {
+    pmm_free_block((uint32_t)page >> PAGE_SHIFT, 0);
+}
+
+// Contiguous run of 'count' pages (at most 2^PMM_MAX_ORDER). The block is
+// rounded up to a power of two and the unused tail given back, so runs
+// of 512 pages or more start on a 2 MB boundary.
+void* pmm_alloc_pages(uint32_t count) {
+    uint8_t order = 0;
+    while ((1u << order) < count) order++;
+    if (order > PMM_MAX_ORDER) return NULL;
+    
+    void* run = pmm_alloc_block(order);
+    if (run && count < (1u << order)) {
+        uint32_t pfn = (uint32_t)run >> PAGE_SHIFT;
+        pmm_free_range(pfn + count, (1u << order) - count);
+    }
+    return run;
+}
+
+void pmm_free_pages(void* run, uint32_t count) {
+    pmm_free_range((uint32_t)run >> PAGE_SHIFT, count);
+}
+
+// Usable part of an E820 entry as page frames [*first, *end), clipped to
+// what a 32-bit kernel can address; false if nothing is left
+static bool e820_usable_pages(const E820Entry* e, uint32_t* first, uint32_t* end) {
+    if (e->type != E820_USABLE || !(e->acpi & 1)) return false;
+    
+    uint64_t base = e->base;
+    uint64_t top = e->base + e->length;
+    if (top > PMM_ADDRESS_LIMIT) top = PMM_ADDRESS_LIMIT;
+    if (base >= top) return false;
+    
+    *first = (uint32_t)((base + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    *end = (uint32_t)(top >> PAGE_SHIFT);
+    return *first < *end;
+}
+
+void pmm_init(const BootInfo* boot) {
+    const E820Entry* map = boot->e820;
+    uint32_t entries = boot->e820_count;
+    uint32_t low = PMM_LOW_MEMORY >> PAGE_SHIFT;
+    uint32_t first, end;
+    
+    if (entries == 0 || entries > E820_MAX_ENTRIES) {
+        map = &e820_fallback;
+        entries = 1;
+    }
+    
+    // page_info must cover the highest usable frame
+    for (uint32_t i = 0; i < entries; i++) {
+        if (e820_usable_pages(&map[i], &first, &end) && end > pmm.page_count) {
+            pmm.page_count = end;
+        }
+    }
+    
+    // Carve page_info out of the first usable region above 1 MB that fits it
+    uint32_t info_pages = (pmm.page_count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t info_first = 0;
+    for (uint32_t i = 0; i < entries && !info_first; i++) {
+        if (!e820_usable_pages(&map[i], &first, &end)) continue;
+        if (first < low) first = low;
+        if (first + info_pages <= end) info_first = first;
+    }
+    if (!info_first) {
+        pmm.page_count = 0;
+        return;
+    }
+    pmm.page_info = (uint8_t*)pfn_block(info_first);
+    memset(pmm.page_info, 0, pmm.page_count);
+    
+    // Hand every usable page above 1 MB to the allocator, except page_info
+    uint32_t info_end = info_first + info_pages;
+    for (uint32_t i = 0; i < entries; i++) {
+        if (!e820_usable_pages(&map[i], &first, &end)) continue;
+        if (first < low) first = low;
+        
+        uint32_t before = end < info_first ? end : info_first;
+        uint32_t after = first > info_end ? first : info_end;
+        if (first < before) pmm_free_range(first, before - first);
+        if (after < end) pmm_free_range(after, end - after);
+    }
+    pmm.total_pages = pmm.free_pages;
+}
+
+// ========================================
+// Paging
+// Identity map of the 32-bit address space, so enabling paging moves
+// nothing. 4 MB PSE pages cover it, except that a 4 MB slot holding
+// part of the framebuffer is split into 4 KB pages so that exactly the
+// framebuffer is write-combining: PAT entry 1 (PWT set) is changed from
+// write-through to WC. Planar Mode X stays on the MTRR default - its
+// writes go through the sequencer map mask and must not be combined.
 // ========================================
 
-static const uint8_t font_data[256 * 8] = {
-    // Space (32)
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    // ! (33)
-    0x18, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00,
-    // " (34)
-    0x36, 0x36, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00,
-    // # (35)
-    0x24, 0x24, 0x7F, 0x24, 0x7F, 0x24, 0x24, 0x00,
-    // $ (36)
-    0x18, 0x3E, 0x60, 0x3C, 0x06, 0x7C, 0x18, 0x00,
-    // % (37)
-    0x62, 0x66, 0x0C, 0x18, 0x30, 0x66, 0x46, 0x00,
-    // & (38)
-    0x1C, 0x36, 0x36, 0x1C, 0x35, 0x66, 0x3A, 0x00,
-    // ' (39)
-    0x18, 0x18, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00,
-    // ( (40)
-    0x0C, 0x18, 0x30, 0x30, 0x30, 0x18, 0x0C, 0x00,
-    // ) (41)
-    0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x18, 0x30, 0x00,
-    // * (42)
-    0x00, 0x24, 0x18, 0x7E, 0x18, 0x24, 0x00, 0x00,
-    // + (43)
-    0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00,
-    // , (44)
-    0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30, 0x00,
-    // - (45)
-    0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00,
-    // . (46)
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00,
-    // / (47)
-    0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x80, 0x00,
-    // 0-9 (48-57)
-    0x3C, 0x66, 0x6E, 0x76, 0x66, 0x66, 0x3C, 0x00,  // 0
-    0x18, 0x38, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00,  // 1
-    0x3C, 0x66, 0x06, 0x1C, 0x30, 0x66, 0x7E, 0x00,  // 2
-    0x3C, 0x66, 0x06, 0x1C, 0x06, 0x66, 0x3C, 0x00,  // 3
-    0x0C, 0x1C, 0x3C, 0x6C, 0x7E, 0x0C, 0x0C, 0x00,  // 4
-    0x7E, 0x60, 0x7C, 0x06, 0x06, 0x66, 0x3C, 0x00,  // 5
-    0x1C, 0x30, 0x60, 0x7C, 0x66, 0x66, 0x3C, 0x00,  // 6
-    0x7E, 0x06, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x00,  // 7
-    0x3C, 0x66, 0x66, 0x3C, 0x66, 0x66, 0x3C, 0x00,  // 8
-    0x3C, 0x66, 0x66, 0x3E, 0x06, 0x0C, 0x38, 0x00,  // 9
-    // : (58)
-    0x00, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00, 0x00,
-    // ; (59)
-    0x00, 0x18, 0x18, 0x00, 0x18, 0x18, 0x30, 0x00,
-    // < (60)
-    0x0C, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0C, 0x00,
-    // = (61)
-    0x00, 0x00, 0x7E, 0x00, 0x7E, 0x00, 0x00, 0x00,
-    // > (62)
-    0x30, 0x18, 0x0C, 0x06, 0x0C, 0x18, 0x30, 0x00,
-    // ? (63)
-    0x3C, 0x66, 0x06, 0x0C, 0x18, 0x00, 0x18, 0x00,
-    // @ (64)
-    0x3C, 0x66, 0x6E, 0x6E, 0x60, 0x62, 0x3C, 0x00,
-    // A-Z (65-90)
-    0x18, 0x3C, 0x66, 0x66, 0x7E, 0x66, 0x66, 0x00,  // A
-    0x7C, 0x66, 0x66, 0x7C, 0x66, 0x66, 0x7C, 0x00,  // B
-    0x3C, 0x66, 0x60, 0x60, 0x60, 0x66, 0x3C, 0x00,  // C
-    0x78, 0x6C, 0x66, 0x66, 0x66, 0x6C, 0x78, 0x00,  // D
-    0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x7E, 0x00,  // E
-    0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x60, 0x00,  // F
-    0x3C, 0x66, 0x60, 0x6E, 0x66, 0x66, 0x3C, 0x00,  // G
-    0x66, 0x66, 0x66, 0x7E, 0x66, 0x66, 0x66, 0x00,  // H
-    0x3C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00,  // I
-    0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x6C, 0x38, 0x00,  // J
-    0x66, 0x6C, 0x78, 0x70, 0x78, 0x6C, 0x66, 0x00,  // K
-    0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x7E, 0x00,  // L
-    0x63, 0x77, 0x7F, 0x6B, 0x63, 0x63, 0x63, 0x00,  // M
-    0x66, 0x76, 0x7E, 0x7E, 0x6E, 0x66, 0x66, 0x00,  // N
-    0x3C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00,  // O
-    0x7C, 0x66, 0x66, 0x7C, 0x60, 0x60, 0x60, 0x00,  // P
-    0x3C, 0x66, 0x66, 0x66, 0x6E, 0x3C, 0x0E, 0x00,  // Q
-    0x7C, 0x66, 0x66, 0x7C, 0x78, 0x6C, 0x66, 0x00,  // R
-    0x3C, 0x66, 0x60, 0x3C, 0x06, 0x66, 0x3C, 0x00,  // S
-    0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00,  // T
-    0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00,  // U
-    0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x18, 0x00,  // V
+// Replace a slot's 4 MB page with a page table mapping the same range
+static uint32_t* paging_split(uint32_t* pd, uint32_t slot) {
+    if (!(pd[slot] & PDE_LARGE)) return (uint32_t*)(pd[slot] & ~(PAGE_SIZE - 1));
+    
+    uint32_t* pt = pmm_alloc_page();
+    if (!pt) return NULL;
+    for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        pt[i] = ((slot << LARGE_PAGE_SHIFT) + (i << PAGE_SHIFT)) | PTE_PRESENT | PTE_WRITE;
+    }
+    pd[slot] = (uint32_t)pt | PTE_PRESENT | PTE_WRITE;
+    return pt;
+}
+
+// Needs the display set up. Without PSE the identity map would take
+// 4 MB of page tables, so the kernel then stays unpaged.
+bool paging_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & CPUID_PSE)) return false;
+    
+    uint32_t* pd = pmm_alloc_page();
+    if (!pd) return false;
+    for (uint32_t slot = 0; slot < PAGE_TABLE_ENTRIES; slot++) {
+        pd[slot] = (slot << LARGE_PAGE_SHIFT) | PTE_PRESENT | PTE_WRITE | PDE_LARGE;
+    }
+    
+    const Framebuffer* fb = &sys->display.fb;
+    if ((edx & CPUID_PAT) && sys->display.mode != PRESENT_PAGE_FLIP) {
+        uint32_t first = (uint32_t)fb->base >> PAGE_SHIFT;
+        uint32_t end = ((uint32_t)fb->base + fb->pitch * fb->height + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        for (uint32_t pfn = first; pfn < end; pfn++) {
+            uint32_t* pt = paging_split(pd, pfn >> (LARGE_PAGE_SHIFT - PAGE_SHIFT));
+            if (!pt) break;
+            pt[pfn & (PAGE_TABLE_ENTRIES - 1)] |= PTE_WC;
+        }
+        
+        // Paging is still off, so no mapping uses entry 1 while it changes
+        uint64_t pat = read_msr(MSR_PAT);
+        pat = (pat & ~(0xFFull << 8)) | ((uint64_t)PAT_WC << 8);
+        write_msr(MSR_PAT, pat);
+    }
+    
+    write_cr3((uint32_t)pd);
+    write_cr4(read_cr4() | CR4_PSE);
+    write_cr0(read_cr0() | CR0_PG);
+    return true;
+}
+
+// ========================================
+// Kernel Heap
+// Slab caches hand out fixed-size objects. A slab is one PMM page: a
+// Slab header, then equal-sized objects with the free ones linked
+// through their first word, so alloc and free are a list pop and push
+// and objects of one kind stay packed in their own pages. Caches of
+// page-sized objects (VMCS, EPT tables) keep recycled pages on a list
+// instead. kmalloc rounds small requests up to a power-of-two cache;
+// larger ones get whole pages behind a Slab header with no cache.
+// ========================================
+
+typedef struct Slab Slab;
+
+typedef struct {
+    uint32_t object_size;
+    Slab* partial;              // Slabs with at least one free object
+    void* free_pages;           // Page-sized caches: recycled pages
+    uint32_t free_page_count;
+} SlabCache;
+
+struct Slab {
+    SlabCache* cache;           // NULL for a large kmalloc block
+    Slab* next;                 // Links on the cache's partial list
+    Slab* prev;
+    void* free;                 // Free objects
+    uint32_t in_use;            // Live objects, or pages of a large block
+};
+
+// Object sizes are rounded to 8 bytes, which also fits the free link
+#define SLAB_CACHE(size) { ((size) + 7) & ~7u, NULL, NULL, 0 }
+
+static SlabCache kmalloc_caches[] = {
+    SLAB_CACHE(16), SLAB_CACHE(32), SLAB_CACHE(64),
+    SLAB_CACHE(128), SLAB_CACHE(256), SLAB_CACHE(SLAB_MAX_OBJECT)
+};
+
+// Slab objects and large kmalloc blocks both sit in the first page of
+// their allocation, right after the header
+static inline Slab* slab_of(const void* obj) {
+    return (Slab*)((uint32_t)obj & ~(PAGE_SIZE - 1));
+}
+
+static void slab_list_push(SlabCache* c, Slab* s) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial) c->partial->prev = s;
+    c->partial = s;
+}
+
+static void slab_list_remove(SlabCache* c, Slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+// New slab with every object free, lowest address first
+static Slab* slab_create(SlabCache* c) {
+    Slab* s = pmm_alloc_page();
+    if (!s) return NULL;
+    
+    s->cache = c;
+    s->in_use = 0;
+    s->free = NULL;
+    uint32_t count = (PAGE_SIZE - SLAB_HEADER_SIZE) / c->object_size;
+    while (count--) {
+        void** obj = (void**)((uint8_t*)s + SLAB_HEADER_SIZE + count * c->object_size);
+        *obj = s->free;
+        s->free = obj;
+    }
+    slab_list_push(c, s);
+    return s;
+}
+
+void* cache_alloc(SlabCache* c) {
+    if (c->object_size == PAGE_SIZE) {
+        void** page = c->free_pages;
+        if (!page) return pmm_alloc_page();
+        c->free_pages = *page;
+        c->free_page_count--;
+        return page;
+    }
+    
+    Slab* s = c->partial;
+    if (!s && !(s = slab_create(c))) return NULL;
+    
+    void** obj = s->free;
+    s->free = *obj;
+    s->in_use++;
+    if (!s->free) slab_list_remove(c, s);   // Full: back on the list at the next free
+    return obj;
+}
+
+void cache_free(SlabCache* c, void* obj) {
+    if (!obj) return;
+    
+    if (c->object_size == PAGE_SIZE) {
+        if (c->free_page_count < SLAB_PAGE_CACHE_KEEP) {
+            *(void**)obj = c->free_pages;
+            c->free_pages = obj;
+            c->free_page_count++;
+        } else {
+            pmm_free_page(obj);
+        }
+        return;
+    }
+    
+    Slab* s = slab_of(obj);
+    if (!s->free) slab_list_push(c, s);
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->in_use--;
+    
+    // Return empty slabs to the PMM, but keep a cache's last one so an
+    // alloc/free cycle does not hit the page allocator every time
+    if (s->in_use == 0 && (s->prev || s->next)) {
+        slab_list_remove(c, s);
+        pmm_free_page(s);
+    }
+}
+
+void* kmalloc(size_t size) {
+    if (size <= SLAB_MAX_OBJECT) {
+        SlabCache* c = kmalloc_caches;
+        while (c->object_size < size) c++;
+        return cache_alloc(c);
+    }
+    
+    uint32_t pages = (size + SLAB_HEADER_SIZE + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    Slab* s = pmm_alloc_pages(pages);
+    if (!s) return NULL;
+    s->cache = NULL;
+    s->in_use = pages;
+    return (uint8_t*)s + SLAB_HEADER_SIZE;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    
+    Slab* s = slab_of(ptr);
+    if (s->cache) {
+        cache_free(s->cache, ptr);
+    } else {
+        pmm_free_pages(s, s->in_use);
+    }
+}
+
+// ========================================
+// Frame Arena
+// Per-frame scratch memory: allocation is a pointer bump and the main
+// loop frees everything at once with arena_reset, so the render path
+// does no allocator bookkeeping at all.
+// ========================================
+
+void arena_init(FrameArena* a, uint32_t size) {
+    a->base = pmm_alloc_pages(size >> PAGE_SHIFT);
+    a->size = a->base ? size : 0;
+    a->used = 0;
+}
+
+// 8-byte aligned; NULL once the frame's budget is spent
+void* arena_push(FrameArena* a, uint32_t size) {
+    uint32_t start = (a->used + 7) & ~7u;
+    if (start > a->size || size > a->size - start) return NULL;
+    a->used = start + size;
+    return a->base + start;
+}
+
+// Pushes made after a mark can be dropped early with arena_release
+static inline uint32_t arena_mark(const FrameArena* a) {
+    return a->used;
+}
+
+static inline void arena_release(FrameArena* a, uint32_t mark) {
+    a->used = mark;
+}
+
+static inline void arena_reset(FrameArena* a) {
+    a->used = 0;
+}
+
+// ========================================
+// Event Rings
+// ========================================
+
+// Depth must be a power of two. Without memory the ring stays at depth
+// 1, which holds nothing: every push counts as dropped until it grows.
+void event_ring_init(EventRing* r, uint32_t slot_size, uint32_t depth) {
+    r->slot_size = slot_size;
+    r->slots = kmalloc(slot_size * depth);
+    r->mask = r->slots ? depth - 1 : 0;
+    r->head = 0;
+    r->tail = 0;
+}
+
+// ISR side: the slot to fill, or NULL (event dropped) when the ring is full
+static inline void* event_ring_reserve(EventRing* r) {
+    if (((r->tail + 1) & r->mask) == r->head) {
+        r->dropped++;
+        return NULL;
+    }
+    return r->slots + r->tail * r->slot_size;
+}
+
+static inline void event_ring_commit(EventRing* r) {
+    barrier();
+    r->tail = (r->tail + 1) & r->mask;
+}
+
+// Main loop side: the oldest queued slot, or NULL when empty
+static inline const void* event_ring_peek(EventRing* r) {
+    if (r->head == r->tail) return NULL;
+    barrier();
+    return r->slots + r->head * r->slot_size;
+}
+
+static inline void event_ring_consume(EventRing* r) {
+    barrier();
+    r->head = (r->head + 1) & r->mask;
+}
+
+// If the ISR dropped events since the last check, double the ring so the
+// next burst fits. Queued events move over with interrupts off.
+void event_ring_grow(EventRing* r) {
+    if (r->dropped == r->dropped_seen) return;
+    r->dropped_seen = r->dropped;
+    
+    uint32_t depth = (r->mask + 1) * 2;
+    uint8_t* slots = kmalloc(depth * r->slot_size);
+    if (!slots) return;     // Out of memory - keep dropping at this depth
+    
+    cli();
+    uint32_t count = 0;
+    for (uint32_t i = r->head; i != r->tail; i = (i + 1) & r->mask) {
+        memcpy(slots + count * r->slot_size, r->slots + i * r->slot_size, r->slot_size);
+        count++;
+    }
+    uint8_t* old = r->slots;
+    r->slots = slots;
+    r->mask = depth - 1;
+    r->head = 0;
+    r->tail = count;
+    sti();
+    
+    kfree(old);
+}
+
+// ========================================
+// Damage Tracking
+// ========================================
+
+static inline int32_t rect_area(const Rect* r) {
+    return r->w * r->h;
+}
+
+bool rect_intersect(const Rect* a, const Rect* b, Rect* out) {
+    int32_t x0 = a->x > b->x ? a->x : b->x;
+    int32_t y0 = a->y > b->y ? a->y : b->y;
+    int32_t x1 = (a->x + a->w < b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int32_t y1 = (a->y + a->h < b->y + b->h) ? a->y + a->h : b->y + b->h;
+    
+    if (x1 <= x0 || y1 <= y0) return false;
+    
+    out->x = x0;
+    out->y = y0;
+    out->w = x1 - x0;
+    out->h = y1 - y0;
+    return true;
+}
+
+Rect rect_union(const Rect* a, const Rect* b) {
+    int32_t x0 = a->x < b->x ? a->x : b->x;
+    int32_t y0 = a->y < b->y ? a->y : b->y;
+    int32_t x1 = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int32_t y1 = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+    
+    Rect r = { x0, y0, x1 - x0, y1 - y0 };
+    return r;
+}
+
+// Add a rect to a damage list, merging where that is cheap
+void damage_add(DamageList* d, int32_t x, int32_t y, int32_t w, int32_t h) {
+    Rect screen = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    Rect r = { x, y, w, h };
+    if (!rect_intersect(&r, &screen, &r)) return;
+    
+    // Fold into existing rects whenever the union costs no extra pixels
+    for (uint32_t i = 0; i < d->count; ) {
+        Rect u = rect_union(&d->rects[i], &r);
+        if (rect_area(&u) <= rect_area(&d->rects[i]) + rect_area(&r)) {
+            r = u;
+            d->rects[i] = d->rects[--d->count];
+            i = 0;  // Grown rect may now swallow earlier entries
+            continue;
+        }
+        i++;
+    }
+    
+    if (d->count < MAX_DIRTY_RECTS) {
+        d->rects[d->count++] = r;
+        return;
+    }
+    
+    // List full - grow whichever rect absorbs this one most cheaply
+    uint32_t best = 0;
+    int32_t best_cost = 0x7FFFFFFF;
+    for (uint32_t i = 0; i < d->count; i++) {
+        Rect u = rect_union(&d->rects[i], &r);
+        int32_t cost = rect_area(&u) - rect_area(&d->rects[i]);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    d->rects[best] = rect_union(&d->rects[best], &r);
+}
+
+// Record a screen region that must be re-rendered and flushed to VGA
+void mark_dirty(int32_t x, int32_t y, int32_t w, int32_t h) {
+    damage_add(&sys->damage, x, y, w, h);
+}
+
+// Record a region whose backbuffer pixels are already correct and only
+// need to reach VGA memory
+void mark_present(int32_t x, int32_t y, int32_t w, int32_t h) {
+    damage_add(&sys->present, x, y, w, h);
+}
+
+bool damage_overlaps(const DamageList* d, const Rect* r) {
+    Rect overlap;
+    for (uint32_t i = 0; i < d->count; i++) {
+        if (rect_intersect(&d->rects[i], r, &overlap)) return true;
+    }
+    return false;
+}
+
+void mark_screen_dirty(void) {
+    mark_dirty(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+// ========================================
+// Font Data (8x8)
+// ========================================
+
+static const uint8_t font_data[256 * 8] = {
+    // Space (32)
+    [32 * 8] = 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // ! (33)
+    0x18, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00,
+    // " (34)
+    0x36, 0x36, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // # (35)
+    0x24, 0x24, 0x7F, 0x24, 0x7F, 0x24, 0x24, 0x00,
+    // $ (36)
+    0x18, 0x3E, 0x60, 0x3C, 0x06, 0x7C, 0x18, 0x00,
+    // % (37)
+    0x62, 0x66, 0x0C, 0x18, 0x30, 0x66, 0x46, 0x00,
+    // & (38)
+    0x1C, 0x36, 0x36, 0x1C, 0x35, 0x66, 0x3A, 0x00,
+    // ' (39)
+    0x18, 0x18, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // ( (40)
+    0x0C, 0x18, 0x30, 0x30, 0x30, 0x18, 0x0C, 0x00,
+    // ) (41)
+    0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x18, 0x30, 0x00,
+    // * (42)
+    0x00, 0x24, 0x18, 0x7E, 0x18, 0x24, 0x00, 0x00,
+    // + (43)
+    0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00,
+    // , (44)
+    0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30, 0x00,
+    // - (45)
+    0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00,
+    // . (46)
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00,
+    // / (47)
+    0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x80, 0x00,
+    // 0-9 (48-57)
+    0x3C, 0x66, 0x6E, 0x76, 0x66, 0x66, 0x3C, 0x00,  // 0
+    0x18, 0x38, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00,  // 1
+    0x3C, 0x66, 0x06, 0x1C, 0x30, 0x66, 0x7E, 0x00,  // 2
+    0x3C, 0x66, 0x06, 0x1C, 0x06, 0x66, 0x3C, 0x00,  // 3
+    0x0C, 0x1C, 0x3C, 0x6C, 0x7E, 0x0C, 0x0C, 0x00,  // 4
+    0x7E, 0x60, 0x7C, 0x06, 0x06, 0x66, 0x3C, 0x00,  // 5
+    0x1C, 0x30, 0x60, 0x7C, 0x66, 0x66, 0x3C, 0x00,  // 6
+    0x7E, 0x06, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x00,  // 7
+    0x3C, 0x66, 0x66, 0x3C, 0x66, 0x66, 0x3C, 0x00,  // 8
+    0x3C, 0x66, 0x66, 0x3E, 0x06, 0x0C, 0x38, 0x00,  // 9
+    // : (58)
+    0x00, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00, 0x00,
+    // ; (59)
+    0x00, 0x18, 0x18, 0x00, 0x18, 0x18, 0x30, 0x00,
+    // < (60)
+    0x0C, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0C, 0x00,
+    // = (61)
+    0x00, 0x00, 0x7E, 0x00, 0x7E, 0x00, 0x00, 0x00,
+    // > (62)
+    0x30, 0x18, 0x0C, 0x06, 0x0C, 0x18, 0x30, 0x00,
+    // ? (63)
+    0x3C, 0x66, 0x06, 0x0C, 0x18, 0x00, 0x18, 0x00,
+    // @ (64)
+    0x3C, 0x66, 0x6E, 0x6E, 0x60, 0x62, 0x3C, 0x00,
+    // A-Z (65-90)
+    0x18, 0x3C, 0x66, 0x66, 0x7E, 0x66, 0x66, 0x00,  // A
+    0x7C, 0x66, 0x66, 0x7C, 0x66, 0x66, 0x7C, 0x00,  // B
+    0x3C, 0x66, 0x60, 0x60, 0x60, 0x66, 0x3C, 0x00,  // C
+    0x78, 0x6C, 0x66, 0x66, 0x66, 0x6C, 0x78, 0x00,  // D
+    0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x7E, 0x00,  // E
+    0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x60, 0x00,  // F
+    0x3C, 0x66, 0x60, 0x6E, 0x66, 0x66, 0x3C, 0x00,  // G
+    0x66, 0x66, 0x66, 0x7E, 0x66, 0x66, 0x66, 0x00,  // H
+    0x3C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00,  // I
+    0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x6C, 0x38, 0x00,  // J
+    0x66, 0x6C, 0x78, 0x70, 0x78, 0x6C, 0x66, 0x00,  // K
+    0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x7E, 0x00,  // L
+    0x63, 0x77, 0x7F, 0x6B, 0x63, 0x63, 0x63, 0x00,  // M
+    0x66, 0x76, 0x7E, 0x7E, 0x6E, 0x66, 0x66, 0x00,  // N
+    0x3C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00,  // O
+    0x7C, 0x66, 0x66, 0x7C, 0x60, 0x60, 0x60, 0x00,  // P
+    0x3C, 0x66, 0x66, 0x66, 0x6E, 0x3C, 0x0E, 0x00,  // Q
+    0x7C, 0x66, 0x66, 0x7C, 0x78, 0x6C, 0x66, 0x00,  // R
+    0x3C, 0x66, 0x60, 0x3C, 0x06, 0x66, 0x3C, 0x00,  // S
+    0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00,  // T
+    0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00,  // U
+    0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x18, 0x00,  // V
     0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00,  // W
     0x66, 0x66, 0x3C, 0x18, 0x3C, 0x66, 0x66, 0x00,  // X
     0x66, 0x66, 0x66, 0x3C, 0x18, 0x18, 0x18, 0x00,  // Y
@@ -333,11 +1378,25 @@ void init_pic(void) {
     outb(PIC2_DATA, 0x01);
     io_wait();
     
-    // Enable keyboard and mouse IRQs
-    outb(PIC1_DATA, 0xFC);  // Enable IRQ0, IRQ1
+    // Enable timer, keyboard, serial and mouse IRQs
+    outb(PIC1_DATA, 0xEC);  // Enable IRQ0, IRQ1, IRQ4
     outb(PIC2_DATA, 0xEF);  // Enable IRQ12
 }
 
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// In-service registers of both PICs (slave in the high byte)
+uint16_t pic_in_service(void) {
+    outb(PIC1_COMMAND, PIC_READ_ISR);
+    outb(PIC2_COMMAND, PIC_READ_ISR);
+    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
+
 // ========================================
 // PS/2 Mouse Driver
 // ========================================
@@ -375,7 +1434,7 @@ void init_mouse(void) {
     outb(MOUSE_STATUS_PORT, 0x20);
     mouse_wait_read();
     uint8_t status = inb(MOUSE_DATA_PORT);
-    status |= 0x02;
+    status |= 0x03;     // IRQ1 and IRQ12 enable
     
     // Set compaq status
     mouse_wait_write();
@@ -398,297 +1457,2122 @@ void init_mouse(void) {
     sys->mouse.buttons = 0;
     sys->mouse.buttons_prev = 0;
     sys->mouse.packet_index = 0;
+    event_ring_init(&sys->mouse_events, sizeof(MouseEvent), EVENT_RING_INITIAL_DEPTH);
 }
 
-void read_mouse(void) {
-    // Process up to 10 mouse packets per frame to avoid infinite loops
-    int packets_processed = 0;
-    const int max_packets = 10;
+// IRQ12 - collect packet bytes and queue each complete packet.
+// Byte 0 always has bit 3 set, so a byte without it means we lost sync.
+__attribute__((interrupt)) void mouse_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    uint8_t data = inb(MOUSE_DATA_PORT);
+    Mouse* m = &sys->mouse;
+    
+    if (m->packet_index == 0 && !(data & 0x08)) {
+        pic_send_eoi(12);
+        return;
+    }
     
-    while ((inb(MOUSE_STATUS_PORT) & 0x21) == 0x21 && packets_processed < max_packets) {  // Bit 0 and bit 5 must be set
-        uint8_t data = inb(MOUSE_DATA_PORT);
-        sys->mouse.packet_buffer[sys->mouse.packet_index] = data;
-        sys->mouse.packet_index++;
+    m->packet_buffer[m->packet_index++] = data;
+    if (m->packet_index == 3) {
+        m->packet_index = 0;
         
-        if (sys->mouse.packet_index < 3) {
-            continue;  // Wait for complete packet
+        MouseEvent* ev = event_ring_reserve(&sys->mouse_events);
+        if (ev) {
+            ev->buttons = m->packet_buffer[0] & 0x07;
+            // 9-bit two's complement, but we use 8-bit signed.
+            // Invert Y axis (screen Y increases downward)
+            ev->dx = (int8_t)m->packet_buffer[1];
+            ev->dy = -(int8_t)m->packet_buffer[2];
+            event_ring_commit(&sys->mouse_events);
+        }
+    }
+    
+    pic_send_eoi(12);
+}
+
+bool get_mouse_event(MouseEvent* ev) {
+    const MouseEvent* queued = event_ring_peek(&sys->mouse_events);
+    if (!queued) {
+        event_ring_grow(&sys->mouse_events);
+        return false;  // Queue empty
+    }
+    
+    *ev = *queued;
+    event_ring_consume(&sys->mouse_events);
+    return true;
+}
+
+// Apply one decoded packet to the cursor state. Motion needs no damage -
+// the cursor overlay catches up at the next frame.
+void apply_mouse_event(const MouseEvent* ev) {
+    sys->mouse.buttons_prev = sys->mouse.buttons;
+    sys->mouse.buttons = ev->buttons;
+    
+    sys->mouse.x += ev->dx;
+    sys->mouse.y += ev->dy;
+    
+    // Clamp to screen bounds
+    if (sys->mouse.x < 0) sys->mouse.x = 0;
+    if (sys->mouse.x >= SCREEN_WIDTH - 8) sys->mouse.x = SCREEN_WIDTH - 8;
+    if (sys->mouse.y < 0) sys->mouse.y = 0;
+    if (sys->mouse.y >= SCREEN_HEIGHT - 8) sys->mouse.y = SCREEN_HEIGHT - 8;
+    
+}
+
+// ========================================
+// Keyboard Driver
+// ========================================
+
+void init_keyboard(void) {
+    event_ring_init(&sys->keyboard, sizeof(uint8_t), EVENT_RING_INITIAL_DEPTH);
+}
+
+// IRQ1 - queue the scancode; drop it if the main loop has fallen behind
+__attribute__((interrupt)) void keyboard_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    uint8_t scancode = inb(KB_DATA_PORT);
+    
+    uint8_t* slot = event_ring_reserve(&sys->keyboard);
+    if (slot) {
+        *slot = scancode;
+        event_ring_commit(&sys->keyboard);
+    }
+    
+    pic_send_eoi(1);
+}
+
+uint8_t get_scancode(void) {
+    const uint8_t* queued = event_ring_peek(&sys->keyboard);
+    if (!queued) {
+        event_ring_grow(&sys->keyboard);
+        return 0;  // Buffer empty
+    }
+    
+    uint8_t scancode = *queued;
+    event_ring_consume(&sys->keyboard);
+    return scancode;
+}
+
+// ========================================
+// Serial Port (COM1)
+// 16550 output for logs and traces - headless runs see it with
+// -serial stdio. Writers only queue bytes in the transmit ring; IRQ4
+// refills the UART FIFO whenever it runs empty, and the idle loops poll
+// it too in case the interrupt never arrives. Nothing here waits on the
+// UART, so logging costs the render loop a memory copy.
+// ========================================
+
+void serial_init(void) {
+    uint16_t divisor = 115200 / SERIAL_BAUD;     // 1.8432 MHz UART clock / 16
+    
+    // An absent UART reads back all ones; the scratch register must hold
+    // what was written
+    outb(COM1_PORT + UART_SCRATCH, 0x5A);
+    if (inb(COM1_PORT + UART_SCRATCH) != 0x5A) return;
+    
+    outb(COM1_PORT + UART_IER, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x80);   // DLAB on to set the divisor
+    outb(COM1_PORT + 0, divisor & 0xFF);
+    outb(COM1_PORT + 1, divisor >> 8);
+    outb(COM1_PORT + UART_LCR, 0x03);   // 8N1, DLAB off
+    outb(COM1_PORT + UART_FCR, 0xC7);   // Enable and clear FIFOs
+    outb(COM1_PORT + UART_MCR, 0x03 | UART_MCR_OUT2);  // DTR + RTS
+    
+    // Older UARTs (and the buggy 16550) have no usable FIFO: one byte
+    // per THR-empty
+    bool fifo = (inb(COM1_PORT + UART_IIR) & UART_IIR_FIFO) == UART_IIR_FIFO;
+    sys->serial.fifo_size = fifo ? UART_FIFO_SIZE : 1;
+    sys->serial.present = true;
+}
+
+// Consumer side, interrupts off: top up an empty FIFO (or holding
+// register), and keep the THR-empty interrupt on only while bytes remain
+static void serial_tx_fill(void) {
+    SerialPort* port = &sys->serial;
+    
+    if (inb(COM1_PORT + UART_LSR) & UART_LSR_THRE) {
+        for (uint32_t n = 0; n < port->fifo_size && port->head != port->tail; n++) {
+            outb(COM1_PORT, port->tx[port->head]);
+            port->head = (port->head + 1) & (SERIAL_TX_SIZE - 1);
+        }
+    }
+    outb(COM1_PORT + UART_IER, port->head != port->tail ? UART_IER_THRE : 0);
+}
+
+// IRQ4 - the transmit FIFO drained
+__attribute__((interrupt)) void serial_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    inb(COM1_PORT + UART_IIR);  // Acknowledge
+    serial_tx_fill();
+    pic_send_eoi(COM1_IRQ);
+}
+
+// Idle loops call this with interrupts off
+void serial_poll(void) {
+    if (sys->serial.present) serial_tx_fill();
+}
+
+// Producer side: append one byte (CRLF for '\n'), dropping it when the
+// ring is full
+static void serial_queue(char c) {
+    SerialPort* port = &sys->serial;
+    
+    if (c == '\n') serial_queue('\r');
+    uint32_t next = (port->tail + 1) & (SERIAL_TX_SIZE - 1);
+    if (next == port->head) {
+        port->dropped++;
+        return;
+    }
+    port->tx[port->tail] = c;
+    barrier();
+    port->tail = next;
+}
+
+// Start the transmitter if it went idle; the IRQ takes over from there
+static void serial_kick(void) {
+    uint32_t flags = irq_save();
+    serial_tx_fill();
+    irq_restore(flags);
+}
+
+void serial_putc(char c) {
+    if (!sys->serial.present) return;
+    serial_queue(c);
+    serial_kick();
+}
+
+void serial_write(const char* str) {
+    if (!sys->serial.present) return;
+    while (*str) serial_queue(*str++);
+    serial_kick();
+}
+
+// Digits of value in base 10 or 16, NUL-terminated; returns the length
+static uint32_t format_uint(char* buf, uint32_t value, uint32_t base) {
+    char digits[10];
+    uint32_t n = 0;
+    
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    for (uint32_t i = 0; i < n; i++) buf[i] = digits[n - 1 - i];
+    buf[n] = 0;
+    return n;
+}
+
+// printf subset: %d %u %x %s %c %%, each with an optional '-' (left
+// align), '0' (zero pad) and field width. Integers are 32-bit. Every
+// character goes to emit(c, ctx).
+static void format_va(void (*emit)(char c, void* ctx), void* ctx, const char* fmt, va_list args) {
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            emit(*fmt, ctx);
+            continue;
+        }
+        
+        bool left = false;
+        char pad = ' ';
+        uint32_t width = 0;
+        fmt++;
+        if (*fmt == '-') {
+            left = true;
+            fmt++;
+        }
+        if (*fmt == '0') {
+            pad = '0';
+            fmt++;
+        }
+        while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        if (!*fmt) break;
+        
+        char buf[12];
+        const char* str = buf;
+        uint32_t len;
+        switch (*fmt) {
+            case 'd': {
+                int32_t v = va_arg(args, int32_t);
+                if (v < 0) buf[0] = '-';
+                len = (v < 0) + format_uint(buf + (v < 0), v < 0 ? -(uint32_t)v : (uint32_t)v, 10);
+                break;
+            }
+            case 'u':
+                len = format_uint(buf, va_arg(args, uint32_t), 10);
+                break;
+            case 'x':
+                len = format_uint(buf, va_arg(args, uint32_t), 16);
+                break;
+            case 's':
+                str = va_arg(args, const char*);
+                len = strlen(str);
+                break;
+            case 'c':
+                buf[0] = (char)va_arg(args, int);
+                len = 1;
+                break;
+            default:            // "%%" and unknown conversions print as is
+                buf[0] = *fmt;
+                len = 1;
+                break;
+        }
+        
+        // The sign goes ahead of zero padding
+        if (pad == '0' && str == buf && buf[0] == '-' && *fmt == 'd') {
+            emit('-', ctx);
+            str++;
+            len--;
+            if (width) width--;
+        }
+        if (!left) {
+            for (; width > len; width--) emit(pad, ctx);
+        }
+        for (uint32_t i = 0; i < len; i++) emit(str[i], ctx);
+        for (; width > len; width--) emit(' ', ctx);
+    }
+}
+
+static void serial_emit(char c, void* ctx) {
+    (void)ctx;
+    serial_queue(c);
+}
+
+// Formatted serial log output. Queued only; a full ring drops the excess.
+void kprintf(const char* fmt, ...) {
+    if (!sys->serial.present) return;
+    
+    va_list args;
+    va_start(args, fmt);
+    format_va(serial_emit, NULL, fmt, args);
+    va_end(args);
+    serial_kick();
+}
+
+typedef struct {
+    char* buf;
+    uint32_t size;
+    uint32_t len;
+} FormatBuffer;
+
+static void buffer_emit(char c, void* ctx) {
+    FormatBuffer* out = ctx;
+    if (out->len + 1 < out->size) out->buf[out->len++] = c;
+}
+
+// kprintf into buf, truncated to size - 1 characters plus the NUL
+uint32_t ksnprintf(char* buf, uint32_t size, const char* fmt, ...) {
+    FormatBuffer out = { buf, size, 0 };
+    va_list args;
+    
+    va_start(args, fmt);
+    format_va(buffer_emit, &out, fmt, args);
+    va_end(args);
+    if (size) buf[out.len] = 0;
+    return out.len;
+}
+
+// ========================================
+// PIT Timer
+// ========================================
+
+static volatile uint32_t timer_ticks;   // Monotonic, TIMER_HZ per second
+
+// Time is kept in PIT input clocks: every IRQ0 adds the length of the
+// period that just ended and whole ticks are moved out of the carry, so
+// a rate change loses neither a partial period nor a remainder
+#define TIMER_TICK_CLOCKS (PIT_FREQUENCY / TIMER_HZ)
+static uint32_t timer_period = TIMER_TICK_CLOCKS;  // Clocks per IRQ0
+static uint32_t timer_carry;            // Clocks not yet counted as ticks
+static bool timer_skip_irq;             // Pending IRQ0 already counted
+
+static void timer_program(uint32_t divisor) {
+    outb(PIT_COMMAND, 0x34);    // Channel 0, lobyte/hibyte, mode 2 (rate generator)
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, divisor >> 8);
+    timer_period = divisor;
+}
+
+// Whole ticks out of the carry; returns how many
+static uint32_t timer_advance(uint32_t clocks) {
+    timer_carry += clocks;
+    uint32_t ticks = timer_carry / TIMER_TICK_CLOCKS;
+    timer_carry -= ticks * TIMER_TICK_CLOCKS;
+    timer_ticks += ticks;
+    return ticks;
+}
+
+void init_timer(void) {
+    timer_program(TIMER_TICK_CLOCKS);
+}
+
+// Switch the IRQ0 rate mid-period with interrupts off. Reprogramming
+// restarts the counter, so the clocks the running period has used are
+// read back first. An IRQ0 already pending at the PIC closed a period
+// at the old rate: count that period here and let the ISR skip it. If
+// the counter wrapped between the latch and the IRR read, the latched
+// count belonged to that period and is covered by it.
+static void timer_set_rate(uint32_t hz) {
+    outb(PIT_COMMAND, 0x00);    // Latch channel 0
+    uint32_t count = inb(PIT_CHANNEL0);
+    count |= inb(PIT_CHANNEL0) << 8;
+    uint32_t elapsed = timer_period - count;
+    
+    outb(PIC1_COMMAND, PIC_READ_IRR);
+    if ((inb(PIC1_COMMAND) & 0x01) && !timer_skip_irq) {
+        if (elapsed > timer_period / 2) elapsed = 0;
+        elapsed += timer_period;
+        timer_skip_irq = true;
+    }
+    
+    timer_program(PIT_FREQUENCY / hz);
+    timer_advance(elapsed);
+}
+
+// Call with interrupts off
+void timer_idle_enter(void) {
+    timer_set_rate(TIMER_IDLE_HZ);
+}
+
+void timer_idle_exit(void) {
+    timer_set_rate(TIMER_HZ);
+}
+
+// IRQ0
+__attribute__((interrupt)) void timer_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    uint32_t ticks = 0;
+    if (timer_skip_irq) {
+        timer_skip_irq = false;
+    } else {
+        ticks = timer_advance(timer_period);
+    }
+#ifdef KERNEL_DEBUG
+    // Sampling profiler: queue where the tick interrupted
+    Sample* sample = event_ring_reserve(&sys->sampler.ring);
+    if (sample) {
+        sample->eip = frame->eip;
+        sample->ticks = ticks;
+        event_ring_commit(&sys->sampler.ring);
+    }
+#else
+    (void)ticks;
+#endif
+    pic_send_eoi(0);
+}
+
+uint32_t timer_get_ticks(void) {
+    return timer_ticks;
+}
+
+// Halt until the tick counter reaches deadline (wrap-safe)
+void timer_sleep_until(uint32_t deadline) {
+    while (1) {
+        cli();
+        serial_poll();
+        if ((int32_t)(timer_ticks - deadline) >= 0) {
+            sti();
+            return;
+        }
+        // STI takes effect after the next instruction, so an IRQ arriving
+        // after the check still wakes the HLT
+        __asm__ volatile ("sti; hlt");
+    }
+}
+
+// ========================================
+// Sampling Profiler (make DEBUG=1)
+// Every IRQ0 tick queues the interrupted EIP. The main loop maps the
+// queued samples to functions through the symbol table the build
+// generates from the linked ELF, and every 10 seconds prints a flat
+// profile of the busiest ones over serial. Halted time shows up under
+// the idle loops, each idle sample weighted by the ticks it covers;
+// inlined code counts towards its caller.
+// ========================================
+
+#ifdef KERNEL_DEBUG
+
+// Generated ksyms.c; weak, so a link without it only loses the names
+extern const KernelSymbol kernel_symbols[] __attribute__((weak));
+extern const uint32_t kernel_symbol_count __attribute__((weak));
+
+static uint32_t symbol_count(void) {
+    return &kernel_symbol_count ? kernel_symbol_count : 0;
+}
+
+// The function containing eip, or symbol_count() if it lies before the
+// first one
+static uint32_t symbol_index(uint32_t eip) {
+    uint32_t n = symbol_count();
+    if (!n || eip < kernel_symbols[0].addr) return n;
+    
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (kernel_symbols[mid].addr <= eip) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Needs the heap; IRQ0 drops its samples until the ring exists
+void sampler_init(void) {
+    SampleProfiler* s = &sys->sampler;
+    uint32_t size = (symbol_count() + 1) * sizeof(uint32_t);
+    
+    event_ring_init(&s->ring, sizeof(Sample), SAMPLE_RING_DEPTH);
+    s->hits = kmalloc(size);
+    if (s->hits) memset(s->hits, 0, size);
+    s->report_tick = timer_ticks;
+}
+
+// Half a ring queued: wake the idle loop before samples get dropped
+bool sampler_due(void) {
+    const EventRing* r = &sys->sampler.ring;
+    return r->mask && ((r->tail - r->head) & r->mask) >= (r->mask + 1) / 2;
+}
+
+// Busiest functions first, then the counts start over
+void sampler_report(void) {
+    SampleProfiler* s = &sys->sampler;
+    uint32_t n = symbol_count();
+    
+    kprintf("prof: %u ms sampled, %u samples dropped\n", s->total, s->ring.dropped - s->dropped_reported);
+    s->dropped_reported = s->ring.dropped;
+    if (!s->hits || !s->total) return;
+    
+    for (uint32_t k = 0; k < SAMPLE_REPORT_TOP; k++) {
+        uint32_t best = 0;
+        for (uint32_t i = 1; i <= n; i++) {
+            if (s->hits[i] > s->hits[best]) best = i;
+        }
+        if (!s->hits[best]) break;
+        
+        uint32_t permille = (uint32_t)udiv64((uint64_t)s->hits[best] * 1000, s->total);
+        kprintf("prof: %3u.%u%% %6u  %s\n", permille / 10, permille % 10, s->hits[best],
+                best < n ? kernel_symbols[best].name : "?");
+        s->hits[best] = 0;
+    }
+    memset(s->hits, 0, (n + 1) * sizeof(uint32_t));
+    s->total = 0;
+}
+
+void sampler_drain(void) {
+    SampleProfiler* s = &sys->sampler;
+    const Sample* sample;
+    
+    while ((sample = event_ring_peek(&s->ring))) {
+        uint32_t i = symbol_index(sample->eip);
+        uint32_t ticks = sample->ticks;
+        event_ring_consume(&s->ring);
+        if (s->hits) s->hits[i] += ticks;
+        s->total += ticks;
+    }
+    
+    if (timer_ticks - s->report_tick >= SAMPLE_REPORT_TICKS) {
+        s->report_tick = timer_ticks;
+        sampler_report();
+    }
+}
+
+#else
+
+static inline void sampler_init(void) {}
+static inline bool sampler_due(void) { return false; }
+static inline void sampler_drain(void) {}
+
+#endif // KERNEL_DEBUG
+
+// ========================================
+// Frame Scheduler
+// ========================================
+
+bool cursor_moved(void);
+bool prof_overlay_due(void);
+
+// Ask for a frame even without damage (for animated elements); the
+// request covers the next rendered frame only
+void request_animation_frame(void) {
+    sys->animation_requested = true;
+}
+
+bool frame_pending(void) {
+    return sys->damage.count > 0 || sys->present.count > 0 ||
+           sys->animation_requested || cursor_moved();
+}
+
+bool input_pending(void) {
+    return sys->keyboard.head != sys->keyboard.tail ||
+           sys->mouse_events.head != sys->mouse_events.tail;
+}
+
+// Idle: nothing to draw, so halt until an input IRQ queues something,
+// the performance overlay is due for a redraw or the sample queue needs
+// draining. The PIT drops to TIMER_IDLE_HZ only once the CPU actually
+// goes to sleep, so an idle desktop wakes 20 times a second (50 ms
+// granularity for the overlay and the serial poll) instead of 1000;
+// frame pacing gets 1 kHz back on return.
+void wait_for_input(void) {
+    bool slowed = false;
+    
+    while (1) {
+        cli();
+        serial_poll();
+        if (input_pending() || prof_overlay_due() || sampler_due()) {
+            if (slowed) timer_idle_exit();
+            sti();
+            return;
+        }
+        if (!slowed) {
+            timer_idle_enter();
+            slowed = true;
+        }
+        __asm__ volatile ("sti; hlt");
+    }
+}
+
+// Fixed-rate frame pacing: deadlines are derived from the frame count so
+// the 1000/60 remainder does not drift
+void frame_wait(void) {
+    // Every FRAME_HZ frames is exactly one second - rebase to avoid overflow
+    if (++sys->frame_count == FRAME_HZ) {
+        sys->frame_epoch += TIMER_HZ;
+        sys->frame_count = 0;
+    }
+    uint32_t deadline = sys->frame_epoch + (sys->frame_count * TIMER_HZ) / FRAME_HZ;
+    
+    // Fell more than a frame behind - restart the schedule rather than
+    // rendering a burst of catch-up frames
+    if ((int32_t)(timer_ticks - deadline) > (int32_t)(TIMER_HZ / FRAME_HZ)) {
+        sys->frame_epoch = timer_ticks;
+        sys->frame_count = 0;
+        return;
+    }
+    
+    timer_sleep_until(deadline);
+}
+
+// ========================================
+// Boot Timeline
+// Each boot step ends at a TSC stamp: the loader's come in through
+// BootInfo, the kernel's are taken by boot_mark. The TSC rate is
+// measured against PIT ticks while the later steps run, then the
+// timeline goes out over serial ("boot: <phase> <ms>") and into a
+// desktop window. Assumes a TSC (Pentium or later).
+// ========================================
+
+void boot_mark(const char* name) {
+    if (boot_timeline.count < BOOT_PHASE_MAX) {
+        BootPhase* phase = &boot_timeline.phases[boot_timeline.count++];
+        phase->name = name;
+        phase->end = rdtsc();
+    }
+}
+
+// Phases the loader stamped. The TSC counts from reset, so the first
+// covers the firmware; an unpack stamp of 0 means nothing was unpacked.
+void boot_timeline_init(const BootInfo* boot) {
+    static const char* const names[BOOT_TSC_COUNT] = {
+        "firmware", "disk load", "video, e820", "unpack", "bss clear"
+    };
+    uint64_t prev = 0;
+    
+    for (uint32_t i = 0; i < BOOT_TSC_COUNT; i++) {
+        if (boot->tsc[i] <= prev) continue;
+        boot_timeline.phases[boot_timeline.count].name = names[i];
+        boot_timeline.phases[boot_timeline.count].end = boot->tsc[i];
+        boot_timeline.count++;
+        prev = boot->tsc[i];
+    }
+}
+
+// Spin to the next PIT tick edge; returns that tick and its TSC
+static uint32_t tsc_at_tick_edge(uint64_t* tsc) {
+    uint32_t tick = timer_ticks;
+    while (timer_ticks == tick);
+    *tsc = rdtsc();
+    return tick + 1;
+}
+
+// Needs the timer running
+void tsc_calibration_start(void) {
+    boot_timeline.calibration_tick = tsc_at_tick_edge(&boot_timeline.calibration_tsc);
+}
+
+// Boot work since the start counts towards the span, so this usually
+// waits only for one tick edge
+void tsc_calibration_finish(void) {
+    uint64_t tsc;
+    uint32_t ticks;
+    
+    do {
+        ticks = tsc_at_tick_edge(&tsc) - boot_timeline.calibration_tick;
+    } while (ticks < BOOT_CALIBRATION_TICKS);
+    
+    uint32_t ms = ticks * (1000 / TIMER_HZ);
+    boot_timeline.tsc_khz = (uint32_t)udiv64(tsc - boot_timeline.calibration_tsc, ms);
+}
+
+// "<name>   12.345 ms" in fixed columns, for the log and the window
+static void boot_format_line(char* line, const char* name, uint64_t cycles) {
+    uint64_t us64 = boot_timeline.tsc_khz ? udiv64(cycles * 1000, boot_timeline.tsc_khz) : 0;
+    uint32_t us = us64 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)us64;    // ~71 minutes
+    char time[BOOT_TIME_MAX + 1];
+    uint32_t len = format_uint(time, us / 1000, 10);
+    
+    time[len++] = '.';
+    time[len++] = '0' + us / 100 % 10;
+    time[len++] = '0' + us / 10 % 10;
+    time[len++] = '0' + us % 10;
+    time[len] = 0;
+    
+    uint32_t n = 0;
+    while (name[n] && n < BOOT_NAME_WIDTH) {
+        line[n] = name[n];
+        n++;
+    }
+    while (n + len < BOOT_NAME_WIDTH + BOOT_TIME_WIDTH) line[n++] = ' ';
+    strcpy(line + n, time);
+    strcpy(line + n + len, " ms");
+}
+
+void boot_timeline_dump(void) {
+    char line[BOOT_LINE_SIZE];
+    uint64_t start = 0;
+    
+    for (uint32_t i = 0; i < boot_timeline.count; i++) {
+        boot_format_line(line, boot_timeline.phases[i].name, boot_timeline.phases[i].end - start);
+        start = boot_timeline.phases[i].end;
+        kprintf("boot: %s\n", line);
+    }
+    boot_format_line(line, "total", start);
+    kprintf("boot: %s (TSC %u MHz)\n", line, boot_timeline.tsc_khz / 1000);
+}
+
+// ========================================
+// Frame Profiler
+// RDTSC laps around the main loop phases, one sample per rendered frame
+// and phase. min/avg/p99 over the last PROF_SAMPLES frames go to serial
+// once a second while frames are being drawn, and to the overlay
+// window (F12) four times a second.
+// ========================================
+
+static const char* const prof_phase_names[PROF_PHASE_COUNT] = {
+    "input", "desktop", "windows", "taskbar", "start menu", "flush", "cursor", "render"
+};
+
+// Charge the time since *lap to a phase and start the next lap
+static inline void prof_lap(ProfPhase phase, uint64_t* lap) {
+    uint64_t now = rdtsc();
+    sys->profiler.pending[phase] += now - *lap;
+    *lap = now;
+}
+
+static uint32_t prof_cycles_to_us(uint64_t cycles) {
+    if (!boot_timeline.tsc_khz) return 0;
+    return (uint32_t)udiv64(cycles * 1000, boot_timeline.tsc_khz);
+}
+
+// One pass over the history. p99 is the PROF_P99_RANK-th largest sample,
+// found by keeping the largest few in a short sorted list.
+void prof_stats(ProfPhase phase, ProfStats* out) {
+    const FrameProfiler* p = &sys->profiler;
+    uint32_t top[PROF_P99_RANK] = { 0 };
+    uint32_t min = 0xFFFFFFFF;
+    uint64_t sum = 0;
+    
+    for (uint32_t i = 0; i < p->count; i++) {
+        uint32_t v = p->samples[phase][i];
+        if (v < min) min = v;
+        sum += v;
+        
+        uint32_t k = PROF_P99_RANK;
+        while (k > 0 && top[k - 1] < v) {
+            if (k < PROF_P99_RANK) top[k] = top[k - 1];
+            k--;
+        }
+        if (k < PROF_P99_RANK) top[k] = v;
+    }
+    
+    if (!p->count) {
+        out->min = out->avg = out->p99 = 0;
+        return;
+    }
+    out->min = prof_cycles_to_us(min);
+    out->avg = prof_cycles_to_us(udiv64(sum, p->count));
+    out->p99 = prof_cycles_to_us(top[p->count < PROF_P99_RANK ? p->count - 1 : PROF_P99_RANK - 1]);
+}
+
+void prof_report(void) {
+    FrameProfiler* p = &sys->profiler;
+    
+    kprintf("perf: %u frames, last %u in us: min avg p99\n", p->frames, p->count);
+    for (uint32_t i = 0; i < PROF_PHASE_COUNT; i++) {
+        ProfStats st;
+        prof_stats(i, &st);
+        kprintf("perf: %-10s %6u %6u %6u\n", prof_phase_names[i], st.min, st.avg, st.p99);
+    }
+    p->frames = 0;
+}
+
+// Close the current frame: its per-phase totals become one sample each
+void prof_frame_end(void) {
+    FrameProfiler* p = &sys->profiler;
+    
+    for (uint32_t i = 0; i < PROF_PHASE_COUNT; i++) {
+        uint64_t cycles = p->pending[i];
+        p->samples[i][p->next] = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+        p->pending[i] = 0;
+    }
+    p->next = (p->next + 1) & (PROF_SAMPLES - 1);
+    if (p->count < PROF_SAMPLES) p->count++;
+    p->frames++;
+    
+    if (timer_ticks - p->report_tick >= PROF_REPORT_TICKS) {
+        p->report_tick = timer_ticks;
+        prof_report();
+    }
+}
+
+bool prof_overlay_due(void) {
+    const FrameProfiler* p = &sys->profiler;
+    return p->overlay && p->overlay->visible &&
+           timer_ticks - p->refresh_tick >= PROF_REFRESH_TICKS;
+}
+
+// ========================================
+// SIMD (opt-in: make SSE2=1)
+// The kernel is compiled for integer registers only. Surface clears and
+// framebuffer copies may still use SSE2 streaming stores inside explicit
+// simd_begin/simd_end regions. The register state is switched
+// lazily: the first region saves whatever state was live (a future task
+// or guest), later regions reuse it, and CR0.TS is left set outside
+// regions so the next foreign FPU/SSE instruction traps (#NM) and gets
+// its state back.
+// ========================================
+
+#ifdef USE_SSE2
+
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE (1 << 25)
+#define CPUID_SSE2 (1 << 26)
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+static bool sse2_enabled = false;   // CPU support found and enabled
+static bool simd_active = false;    // Inside simd_begin/simd_end
+static bool simd_owns_state = false; // SSE registers hold kernel values
+static uint8_t fpu_saved[512] __attribute__((aligned(16)));  // FXSAVE image
+
+static inline void clts(void) {
+    __asm__ volatile ("clts");
+}
+
+// Enable SSE if CPUID reports FXSR, SSE and SSE2; otherwise every
+// caller stays on the integer paths
+void simd_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t needed = CPUID_FXSR | CPUID_SSE | CPUID_SSE2;
+    
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if ((edx & needed) != needed) return;
+    
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+    
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    
+    __asm__ volatile ("fninit");
+    __asm__ volatile ("fxsave %0" : "=m"(fpu_saved));
+    write_cr0(read_cr0() | CR0_TS);
+    sse2_enabled = true;
+}
+
+// Regions do not nest; without SSE2 they are no-ops
+static inline void simd_begin(void) {
+    if (!sse2_enabled) return;
+    
+    clts();
+    if (!simd_owns_state) {
+        __asm__ volatile ("fxsave %0" : "=m"(fpu_saved));
+        simd_owns_state = true;
+    }
+    simd_active = true;
+}
+
+static inline void simd_end(void) {
+    if (!simd_active) return;
+    
+    simd_active = false;
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// #NM: someone else touched the FPU/SSE state outside a kernel region -
+// hand back the state saved when the kernel took it over
+__attribute__((interrupt)) void fpu_unavailable_handler(InterruptFrame* frame) {
+    (void)frame;
+    clts();
+    if (simd_owns_state) {
+        __asm__ volatile ("fxrstor %0" : : "m"(fpu_saved));
+        simd_owns_state = false;
+    }
+}
+
+#else
+
+static inline void simd_init(void) {}
+static inline void simd_begin(void) {}
+static inline void simd_end(void) {}
+
+#endif // USE_SSE2
+
+// Whole-surface clears and copies into the framebuffer are written once
+// and not read back, so inside a SIMD region they bypass the cache.
+// Drawing fills stay on rep stosl - their spans are read back by the
+// flush while still cached, where streaming stores lose (make bench).
+static inline void bulk_fill(void* dst, uint8_t c, size_t n) {
+#ifdef USE_SSE2
+    if (simd_active) {
+        mem_fill_stream(dst, c, n);
+        return;
+    }
+#endif
+    mem_fill(dst, c, n);
+}
+
+static inline void bulk_copy(void* dst, const void* src, size_t n) {
+#ifdef USE_SSE2
+    if (simd_active) {
+        mem_copy_stream(dst, src, n);
+        return;
+    }
+#endif
+    mem_copy(dst, src, n);
+}
+
+// ========================================
+// Interrupt Descriptor Table
+// ========================================
+
+void display_show_fault(void);
+
+static IdtEntry idt[256];
+
+void idt_set_gate(uint8_t vector, void* handler) {
+    uint32_t addr = (uint32_t)handler;
+    idt[vector].offset_low = addr & 0xFFFF;
+    idt[vector].selector = 0x08;    // Kernel code segment
+    idt[vector].zero = 0;
+    idt[vector].type_attr = 0x8E;   // Present, ring 0, 32-bit interrupt gate
+    idt[vector].offset_high = addr >> 16;
+}
+
+// CPU exceptions are fatal - paint a red bar so the halt is visible
+static void exception_halt(void) {
+    cli();
+    display_show_fault();
+    while (1) hlt();
+}
+
+__attribute__((interrupt)) void exception_handler(InterruptFrame* frame) {
+    (void)frame;
+    exception_halt();
+}
+
+__attribute__((interrupt)) void exception_handler_err(InterruptFrame* frame, uint32_t error_code) {
+    (void)frame;
+    (void)error_code;
+    exception_halt();
+}
+
+// Masked lines and spurious IRQ7/IRQ15 - only acknowledge real ones
+__attribute__((interrupt)) void master_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    if (pic_in_service() & 0x00FF) {
+        outb(PIC1_COMMAND, PIC_EOI);
+    }
+}
+
+__attribute__((interrupt)) void slave_irq_handler(InterruptFrame* frame) {
+    (void)frame;
+    if (pic_in_service() & 0xFF00) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);  // Cascade line is always real
+}
+
+void init_idt(void) {
+    for (int v = 0; v < 32; v++) {
+        bool has_error_code = (v == 8) || (v >= 10 && v <= 14) ||
+                              v == 17 || v == 21 || v == 29 || v == 30;
+        idt_set_gate(v, has_error_code ? (void*)exception_handler_err
+                                       : (void*)exception_handler);
+    }
+    
+    for (int irq = 0; irq < 16; irq++) {
+        idt_set_gate(IRQ_BASE + irq, irq < 8 ? (void*)master_irq_handler
+                                             : (void*)slave_irq_handler);
+    }
+#ifdef USE_SSE2
+    idt_set_gate(7, fpu_unavailable_handler);
+#endif
+    idt_set_gate(IRQ_BASE + 0, timer_irq_handler);
+    idt_set_gate(IRQ_BASE + 1, keyboard_irq_handler);
+    idt_set_gate(IRQ_BASE + COM1_IRQ, serial_irq_handler);
+    idt_set_gate(IRQ_BASE + 12, mouse_irq_handler);
+    
+    IdtPointer idtr = { sizeof(idt) - 1, (uint32_t)idt };
+    __asm__ volatile ("lidt %0" : : "m"(idtr));
+}
+
+// ========================================
+// Blit Kernels
+// Surfaces (backbuffer, desktop layer) hold native pixels: 8-bit color
+// indices on 8 bpp framebuffers, 32-bit pixels otherwise. Each operation
+// is stamped out per pixel size by DEFINE_BLIT_OPS and the table for the
+// active mode is picked once in framebuffer_init, so no inner loop
+// branches on the format.
+// ========================================
+
+// Byte masks for 4 pixels from one nibble of a glyph row (MSB = leftmost
+// pixel, stored in the lowest byte)
+static const uint32_t nibble_mask[16] = {
+    0x00000000, 0xFF000000, 0x00FF0000, 0xFFFF0000,
+    0x0000FF00, 0xFF00FF00, 0x00FFFF00, 0xFFFFFF00,
+    0x000000FF, 0xFF0000FF, 0x00FF00FF, 0xFFFF00FF,
+    0x0000FFFF, 0xFF00FFFF, 0x00FFFFFF, 0xFFFFFFFF
+};
+
+typedef uint32_t __attribute__((aligned(1), may_alias)) unaligned_u32;
+
+static inline void fill_run_8(uint8_t* dst, uint32_t pixel, int32_t n) {
+    mem_fill(dst, pixel, n);
+}
+
+// rep stosl only pays off past a few pixels (1-pixel borders are common)
+static inline void fill_run_32(uint8_t* dst, uint32_t pixel, int32_t n) {
+    if (n < 8) {
+        uint32_t* d = (uint32_t*)dst;
+        while (n--) *d++ = pixel;
+    } else {
+        mem_fill32(dst, pixel, n);
+    }
+}
+
+// 8 bpp glyph row: each nibble becomes one masked dword store
+static inline void glyph_row_8(uint8_t* dst, uint8_t bits, uint32_t pixel) {
+    unaligned_u32* d = (unaligned_u32*)dst;
+    uint32_t color32 = pixel * 0x01010101u;
+    uint32_t m0 = nibble_mask[bits >> 4];
+    uint32_t m1 = nibble_mask[bits & 0x0F];
+    d[0] = (d[0] & ~m0) | (color32 & m0);
+    d[1] = (d[1] & ~m1) | (color32 & m1);
+}
+
+static inline void glyph_row_32(uint8_t* dst, uint8_t bits, uint32_t pixel) {
+    uint32_t* d = (uint32_t*)dst;
+    for (int i = 0; i < 8; i++) {
+        if (bits & (0x80 >> i)) d[i] = pixel;
+    }
+}
+
+// Color index -> surface pixel
+#define INDEX_PIXEL_8(c) (c)
+#define INDEX_PIXEL_32(c) (sys->display.fb.palette[c])
+
+// fill:             n pixels of one value
+// copy:             n surface pixels, overlap-safe
+// copy_transparent: n color indices, SPRITE_KEY entries left untouched
+// glyph:            unclipped 8x8 1-bit glyph
+// glyph_clipped:    'rows' glyph rows, columns first..last-1 only
+#define DEFINE_BLIT_OPS(bits, pixel_t, fill_run, glyph_row, index_pixel)              \
+    static void blit_fill_##bits(uint8_t* dst, uint32_t pixel, int32_t n) {            \
+        fill_run(dst, pixel, n);                                                       \
+    }                                                                                  \
+                                                                                       \
+    static void blit_copy_##bits(uint8_t* dst, const uint8_t* src, int32_t n) {        \
+        mem_move(dst, src, n * sizeof(pixel_t));                                       \
+    }                                                                                  \
+                                                                                       \
+    static void blit_copy_transparent_##bits(uint8_t* dst, const uint8_t* src,         \
+                                             int32_t n) {                              \
+        pixel_t* d = (pixel_t*)dst;                                                    \
+        for (int32_t i = 0; i < n; i++) {                                              \
+            if (src[i] != SPRITE_KEY) d[i] = index_pixel(src[i]);                      \
+        }                                                                              \
+    }                                                                                  \
+                                                                                       \
+    static void blit_glyph_##bits(uint8_t* dst, int32_t pitch, const uint8_t* glyph,   \
+                                  uint32_t pixel) {                                    \
+        for (int j = 0; j < 8; j++, dst += pitch) {                                    \
+            if (glyph[j]) glyph_row(dst, glyph[j], pixel);                             \
+        }                                                                              \
+    }                                                                                  \
+                                                                                       \
+    static void blit_glyph_clipped_##bits(uint8_t* dst, int32_t pitch,                \
+                                          const uint8_t* glyph, int32_t rows,          \
+                                          int32_t first, int32_t last,                 \
+                                          uint32_t pixel) {                            \
+        for (int32_t j = 0; j < rows; j++, dst += pitch) {                             \
+            pixel_t* d = (pixel_t*)dst;                                                \
+            for (int32_t i = first; i < last; i++) {                                   \
+                if (glyph[j] & (0x80 >> i)) d[i] = pixel;                              \
+            }                                                                          \
+        }                                                                              \
+    }                                                                                  \
+                                                                                       \
+    static const BlitOps blit_ops_##bits = {                                           \
+        sizeof(pixel_t),                                                               \
+        blit_fill_##bits,                                                              \
+        blit_copy_##bits,                                                              \
+        blit_copy_transparent_##bits,                                                  \
+        blit_glyph_##bits,                                                             \
+        blit_glyph_clipped_##bits                                                      \
+    };
+
+DEFINE_BLIT_OPS(8, uint8_t, fill_run_8, glyph_row_8, INDEX_PIXEL_8)
+DEFINE_BLIT_OPS(32, uint32_t, fill_run_32, glyph_row_32, INDEX_PIXEL_32)
+
+// Surface pixel for a color index
+static inline uint32_t color_pixel(uint8_t color) {
+    return sys->display.fb.palette[color];
+}
+
+static inline int32_t surface_pitch(void) {
+    return SCREEN_WIDTH * sys->blit->bytes_per_pixel;
+}
+
+static inline uint8_t* pixel_at(uint8_t* surface, int32_t x, int32_t y) {
+    return surface + (y * SCREEN_WIDTH + x) * sys->blit->bytes_per_pixel;
+}
+
+// ========================================
+// Graphics Functions
+// ========================================
+
+void reset_clip(void) {
+    sys->clip.x = 0;
+    sys->clip.y = 0;
+    sys->clip.w = SCREEN_WIDTH;
+    sys->clip.h = SCREEN_HEIGHT;
+}
+
+void set_pixel(int32_t x, int32_t y, uint8_t color) {
+    const Rect* c = &sys->clip;
+    if (x >= c->x && x < c->x + c->w && y >= c->y && y < c->y + c->h) {
+        sys->blit->fill(pixel_at(sys->target, x, y), color_pixel(color), 1);
+    }
+}
+
+// Quick reject for primitives that lie entirely outside the clip rect
+static inline bool clip_overlaps(int32_t x, int32_t y, int32_t w, int32_t h) {
+    const Rect* c = &sys->clip;
+    return x < c->x + c->w && x + w > c->x && y < c->y + c->h && y + h > c->y;
+}
+
+// Clip once against the clip rect, then fill whole scanline spans
+void draw_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
+    Rect r = { x, y, w, h };
+    if (!rect_intersect(&r, &sys->clip, &r)) return;
+    
+    uint32_t pixel = color_pixel(color);
+    int32_t pitch = surface_pitch();
+    uint8_t* row = pixel_at(sys->target, r.x, r.y);
+    for (int32_t j = 0; j < r.h; j++) {
+        sys->blit->fill(row, pixel, r.w);
+        row += pitch;
+    }
+}
+
+// Overlap-safe copy of src to (dst_x, dst_y) within the target surface
+// (a BitBlt). Rows run bottom-up when moving down so none is overwritten
+// before it is read; the copy kernel handles the horizontal overlap.
+void copy_rect(const Rect* src, int32_t dst_x, int32_t dst_y) {
+    uint8_t* from = pixel_at(sys->target, src->x, src->y);
+    uint8_t* to = pixel_at(sys->target, dst_x, dst_y);
+    int32_t step = surface_pitch();
+    
+    if (dst_y > src->y) {
+        from += (src->h - 1) * step;
+        to += (src->h - 1) * step;
+        step = -step;
+    }
+    
+    for (int32_t j = 0; j < src->h; j++) {
+        sys->blit->copy(to, from, src->w);
+        from += step;
+        to += step;
+    }
+}
+
+void draw_rect_border(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
+    if (!clip_overlaps(x, y, w, h)) return;
+    
+    // Top and bottom
+    draw_rect(x, y, w, 1, color);
+    draw_rect(x, y + h - 1, w, 1, color);
+    
+    // Left and right
+    draw_rect(x, y, 1, h, color);
+    draw_rect(x + w - 1, y, 1, h, color);
+}
+
+// Glyph straddling the clip edge: clip the 8x8 box once, then test bits
+static void blit_glyph_clipped(int32_t x, int32_t y, const uint8_t* glyph, uint8_t color) {
+    Rect r = { x, y, 8, 8 };
+    if (!rect_intersect(&r, &sys->clip, &r)) return;
+    
+    // Row pointer stays at the glyph's left edge; only columns inside the
+    // clip are written
+    sys->blit->glyph_clipped(pixel_at(sys->target, x, r.y), surface_pitch(),
+                             glyph + (r.y - y), r.h, r.x - x, r.x - x + r.w,
+                             color_pixel(color));
+}
+
+static inline bool clip_contains(int32_t x, int32_t y, int32_t w, int32_t h) {
+    const Rect* c = &sys->clip;
+    return x >= c->x && x + w <= c->x + c->w && y >= c->y && y + h <= c->y + c->h;
+}
+
+void draw_char(int32_t x, int32_t y, char c, uint8_t color) {
+    uint8_t code = (uint8_t)c;
+    if (code < 32) return;
+    
+    const uint8_t* glyph = &font_data[code * 8];
+    if (clip_contains(x, y, 8, 8)) {
+        sys->blit->glyph(pixel_at(sys->target, x, y), surface_pitch(), glyph, color_pixel(color));
+    } else {
+        blit_glyph_clipped(x, y, glyph, color);
+    }
+}
+
+// Whole runs are culled or drawn unclipped with a single test
+void draw_string(int32_t x, int32_t y, const char* str, uint8_t color) {
+    int32_t w = strlen(str) * 8;
+    if (!clip_overlaps(x, y, w, 8)) return;
+    
+    if (!clip_contains(x, y, w, 8)) {
+        for (; *str; str++, x += 8) {
+            draw_char(x, y, *str, color);
+        }
+        return;
+    }
+    
+    const BlitOps* blit = sys->blit;
+    uint32_t pixel = color_pixel(color);
+    int32_t pitch = surface_pitch();
+    int32_t advance = 8 * blit->bytes_per_pixel;
+    uint8_t* dst = pixel_at(sys->target, x, y);
+    for (; *str; str++, dst += advance) {
+        uint8_t code = (uint8_t)*str;
+        if (code >= 32) {
+            blit->glyph(dst, pitch, &font_data[code * 8], pixel);
+        }
+    }
+}
+
+void draw_button_3d(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
+    // Base
+    draw_rect(x, y, w, h, color);
+    
+    // Highlight (top-left)
+    draw_rect(x, y, w, 1, 15);  // Top
+    draw_rect(x, y, 1, h, 15);  // Left
+    
+    // Shadow (bottom-right)
+    draw_rect(x, y + h - 1, w, 1, 0);       // Bottom
+    draw_rect(x + w - 1, y, 1, h, 0);       // Right
+}
+
+// ========================================
+// Desktop & UI Rendering
+// ========================================
+
+void draw_desktop_gradient(void) {
+    // Gradient background (only the rows and columns inside the clip)
+    Rect r = { 0, 0, SCREEN_WIDTH, DESKTOP_HEIGHT };
+    if (!rect_intersect(&r, &sys->clip, &r)) return;
+    
+    int32_t pitch = surface_pitch();
+    uint8_t* row = pixel_at(sys->target, r.x, r.y);
+    for (int32_t y = r.y; y < r.y + r.h; y++) {
+        sys->blit->fill(row, color_pixel(1 + (y * 12) / DESKTOP_HEIGHT), r.w);
+        row += pitch;
+    }
+}
+
+void draw_taskbar(void) {
+    // Taskbar background
+    draw_rect(0, SCREEN_HEIGHT - 10, SCREEN_WIDTH, 10, 8);
+    
+    // Start button
+    draw_button_3d(2, SCREEN_HEIGHT - 8, 60, 8, 7);
+    draw_string(16, SCREEN_HEIGHT - 6, "START", 0);
+}
+
+void draw_start_menu(void) {
+    if (!sys->start_menu_open) return;
+    if (!clip_overlaps(START_MENU_X, START_MENU_Y, START_MENU_W, START_MENU_H)) return;
+    
+    int32_t y = START_MENU_Y;
+    
+    // Menu background with shadow
+    draw_rect(4, y + 2, 80, 85, 0);  // Shadow
+    draw_rect(2, y, 80, 85, 7);  // Menu
+    draw_rect_border(2, y, 80, 85, 15);
+    
+    // Menu items
+    draw_string(10, y + 10, "Programs", 0);
+    draw_string(10, y + 25, "Documents", 0);
+    draw_string(10, y + 40, "Settings", 0);
+    draw_string(10, y + 55, "Hypervisor", 0);
+    draw_string(10, y + 70, "Shutdown", 0);
+}
+
+void draw_desktop_icon(int32_t x, int32_t y, uint8_t type, const char* name) {
+    // Icon background
+    draw_rect(x, y, 32, 32, type == 0 ? 9 : (type == 1 ? 14 : 15));
+    
+    // Icon details (simplified)
+    if (type == 0) {  // Computer
+        draw_rect(x + 6, y + 4, 20, 16, 15);
+        draw_rect(x + 8, y + 6, 16, 12, 9);
+        draw_rect(x + 12, y + 20, 8, 8, 15);
+    } else if (type == 1) {  // Folder
+        draw_rect(x + 4, y + 10, 24, 18, 14);
+        draw_rect(x + 4, y + 6, 12, 4, 14);
+    } else {  // Document
+        draw_rect(x + 8, y + 4, 16, 24, 15);
+        draw_rect(x + 10, y + 10, 12, 1, 0);
+        draw_rect(x + 10, y + 14, 12, 1, 0);
+        draw_rect(x + 10, y + 18, 12, 1, 0);
+    }
+    
+    // Icon label
+    draw_string(x + 2, y + 34, name, 15);
+}
+
+void draw_desktop_icons(void) {
+    draw_desktop_icon(10, 10, 0, "My PC");
+    draw_desktop_icon(10, 60, 1, "Files");
+    draw_desktop_icon(10, 110, 2, "Notes");
+}
+
+// ========================================
+// Desktop Layer
+// Wallpaper and icons never change between frames, so they are rendered
+// once into a retained surface and composited by copying scanlines.
+// ========================================
+
+void rebuild_desktop_layer(void) {
+    uint8_t* saved_target = sys->target;
+    Rect saved_clip = sys->clip;
+    
+    sys->target = sys->desktop_layer;
+    reset_clip();
+    draw_desktop_gradient();
+    draw_desktop_icons();
+    
+    sys->target = saved_target;
+    sys->clip = saved_clip;
+    sys->desktop_layer_valid = true;
+}
+
+// Force a rebuild (e.g. after icons change) and repaint the whole desktop
+void invalidate_desktop_layer(void) {
+    sys->desktop_layer_valid = false;
+    mark_dirty(0, 0, SCREEN_WIDTH, DESKTOP_HEIGHT);
+}
+
+// Copy the exposed part of the desktop layer into the backbuffer
+void draw_desktop(void) {
+    if (!sys->desktop_layer_valid) {
+        rebuild_desktop_layer();
+    }
+    
+    Rect r = { 0, 0, SCREEN_WIDTH, DESKTOP_HEIGHT };
+    if (!rect_intersect(&r, &sys->clip, &r)) return;
+    
+    int32_t pitch = surface_pitch();
+    uint32_t offset = pixel_at(sys->target, r.x, r.y) - sys->target;
+    for (int32_t j = 0; j < r.h; j++) {
+        sys->blit->copy(sys->target + offset, sys->desktop_layer + offset, r.w);
+        offset += pitch;
+    }
+}
+
+void draw_window(Window* win) {
+    if (!win->visible || win->minimized) return;
+    if (!clip_overlaps(win->x, win->y, win->width + 2, win->height + 2)) return;
+    
+    // Shadow
+    draw_rect(win->x + 2, win->y + 2, win->width, win->height, 0);
+    
+    // Title bar
+    draw_rect(win->x, win->y, win->width, 12, 8);
+    
+    // Window body
+    draw_rect(win->x, win->y + 12, win->width, win->height - 12, win->color);
+    
+    // Border
+    draw_rect_border(win->x, win->y, win->width, win->height, 15);
+    
+    // Close button
+    draw_button_3d(win->x + win->width - 14, win->y + 2, 10, 8, 12);
+    draw_string(win->x + win->width - 11, win->y + 4, "X", 15);
+    
+    // Title
+    draw_string(win->x + 5, win->y + 3, win->title, 15);
+    
+    // Special content for hypervisor window
+    if (strcmp(win->title, "Hypervisor Status") == 0) {
+        draw_string(win->x + 10, win->y + 20, "VT-x: ", 15);
+        if (vtx_supported) {
+            draw_string(win->x + 50, win->y + 20, "Supported", 10);
+        } else {
+            draw_string(win->x + 50, win->y + 20, "Not Supported", 12);
+        }
+        
+        draw_string(win->x + 10, win->y + 35, "EPT: Initialized", 10);
+        draw_string(win->x + 10, win->y + 50, "VMCS: Ready", 10);
+        draw_string(win->x + 10, win->y + 65, "I/O Trap: Enabled", 10);
+    }
+    
+    // Boot phases, one per row, as long as they fit
+    if (strcmp(win->title, BOOT_TIMELINE_TITLE) == 0) {
+        char line[BOOT_LINE_SIZE];
+        uint64_t start = 0;
+        int32_t y = win->y + 18;
+        int32_t bottom = win->y + win->height - 28;
+        
+        for (uint32_t i = 0; i < boot_timeline.count && y <= bottom; i++, y += 10) {
+            boot_format_line(line, boot_timeline.phases[i].name, boot_timeline.phases[i].end - start);
+            start = boot_timeline.phases[i].end;
+            draw_string(win->x + 10, y, line, 15);
+        }
+        
+        start = boot_timeline.count ? boot_timeline.phases[boot_timeline.count - 1].end : 0;
+        boot_format_line(line, "total", start);
+        draw_string(win->x + 10, y + 2, line, 14);
+        
+        char mhz[BOOT_LINE_SIZE] = "TSC ";
+        uint32_t len = format_uint(mhz + 4, boot_timeline.tsc_khz / 1000, 10);
+        strcpy(mhz + 4 + len, " MHz");
+        draw_string(win->x + 10, y + 12, mhz, 7);
+    }
+    
+    // Frame profile in microseconds, same numbers as the serial report
+    if (strcmp(win->title, PROF_OVERLAY_TITLE) == 0) {
+        char line[40];
+        int32_t y = win->y + 18;
+        
+        draw_string(win->x + 8, y, "phase         min   avg   p99", 14);
+        for (uint32_t i = 0; i < PROF_PHASE_COUNT; i++) {
+            ProfStats st;
+            prof_stats(i, &st);
+            ksnprintf(line, sizeof(line), "%-10s %6u%6u%6u", prof_phase_names[i], st.min, st.avg, st.p99);
+            y += 10;
+            draw_string(win->x + 8, y, line, i == PROF_RENDER ? 15 : 7);
+        }
+    }
+}
+
+// ========================================
+// Compositor
+// Layers, bottom to top: desktop, windows in z-order, taskbar, start menu.
+// Each layer is rasterized only inside its visible region - its area
+// minus every opaque rect above it - so covered pixels are never drawn.
+// ========================================
+
+static inline void region_init(Region* rg) {
+    rg->rects = NULL;
+    rg->count = 0;
+    rg->capacity = 0;
+}
+
+void region_add(Region* rg, const Rect* r) {
+    if (r->w <= 0 || r->h <= 0) return;
+    
+    if (rg->count == rg->capacity) {
+        uint32_t capacity = rg->capacity ? rg->capacity * 2 : REGION_INITIAL_RECTS;
+        Rect* rects = arena_push(&sys->frame_arena, capacity * sizeof(Rect));
+        if (!rects) return;
+        memcpy(rects, rg->rects, rg->count * sizeof(Rect));
+        rg->rects = rects;
+        rg->capacity = capacity;
+    }
+    rg->rects[rg->count++] = *r;
+}
+
+// Cut hole out of every rect (each splits into at most four bands). If the
+// arena cannot hold the result, the region is left as is: layers paint
+// bottom to top, so skipping a cut only costs overdraw, never correctness.
+bool region_subtract(Region* rg, const Rect* hole) {
+    uint32_t mark = arena_mark(&sys->frame_arena);
+    Rect* out = arena_push(&sys->frame_arena, rg->count * 4 * sizeof(Rect));
+    if (!out) return false;
+    
+    uint32_t count = 0;
+    bool cut = false;
+    for (uint32_t i = 0; i < rg->count; i++) {
+        const Rect* r = &rg->rects[i];
+        Rect in;
+        if (!rect_intersect(r, hole, &in)) {
+            out[count++] = *r;
+            continue;
+        }
+        
+        Rect bands[4] = {
+            { r->x, r->y, r->w, in.y - r->y },                             // Above
+            { r->x, in.y + in.h, r->w, r->y + r->h - (in.y + in.h) },      // Below
+            { r->x, in.y, in.x - r->x, in.h },                             // Left
+            { in.x + in.w, in.y, r->x + r->w - (in.x + in.w), in.h }       // Right
+        };
+        for (int b = 0; b < 4; b++) {
+            if (bands[b].w <= 0 || bands[b].h <= 0) continue;
+            out[count++] = bands[b];
+        }
+        cut = true;
+    }
+    
+    // Most holes miss the region entirely - give the copy straight back
+    if (!cut) {
+        arena_release(&sys->frame_arena, mark);
+        return true;
+    }
+    rg->capacity = rg->count * 4;
+    rg->rects = out;
+    rg->count = count;
+    return true;
+}
+
+// Opaque footprint of a window: body plus the drop shadow offset by 2
+static inline void window_body(const Window* win, Rect* r) {
+    r->x = win->x;
+    r->y = win->y;
+    r->w = win->width;
+    r->h = win->height;
+}
+
+static inline void window_shadow(const Window* win, Rect* r) {
+    r->x = win->x + 2;
+    r->y = win->y + 2;
+    r->w = win->width;
+    r->h = win->height;
+}
+
+static inline bool window_shown(const Window* win) {
+    return win->visible && !win->minimized;
+}
+
+// Remove everything above z-position 'z' from the region. Windows from z
+// upwards, then the taskbar, then the start menu (if open).
+void region_subtract_above(Region* rg, uint32_t z, bool include_taskbar) {
+    for (uint32_t k = z; k < sys->window_count; k++) {
+        const Window* win = sys->z_order[k];
+        if (!window_shown(win)) continue;
+        
+        Rect r;
+        window_body(win, &r);
+        region_subtract(rg, &r);
+        window_shadow(win, &r);
+        region_subtract(rg, &r);
+    }
+    
+    if (include_taskbar) {
+        Rect taskbar = { 0, DESKTOP_HEIGHT, SCREEN_WIDTH, TASKBAR_HEIGHT };
+        region_subtract(rg, &taskbar);
+    }
+    
+    if (sys->start_menu_open) {
+        Rect menu = { START_MENU_X, START_MENU_Y, START_MENU_W - 2, START_MENU_H - 2 };
+        Rect shadow = { START_MENU_X + 2, START_MENU_Y + 2, START_MENU_W - 2, START_MENU_H - 2 };
+        region_subtract(rg, &menu);
+        region_subtract(rg, &shadow);
+    }
+}
+
+// Run a draw function once per rect of the region, clipped to that rect
+static void draw_region(const Region* rg, void (*draw)(void* arg), void* arg) {
+    for (uint32_t i = 0; i < rg->count; i++) {
+        sys->clip = rg->rects[i];
+        draw(arg);
+    }
+}
+
+static void draw_desktop_cb(void* arg) {
+    (void)arg;
+    draw_desktop();
+}
+
+static void draw_window_cb(void* arg) {
+    draw_window((Window*)arg);
+}
+
+static void draw_taskbar_cb(void* arg) {
+    (void)arg;
+    draw_taskbar();
+}
+
+// Composite every layer into the backbuffer inside one damaged rect
+void compose_rect(const Rect* damage) {
+    uint32_t mark = arena_mark(&sys->frame_arena);
+    uint64_t lap = rdtsc();
+    Region vis;
+    
+    // Desktop: whatever no window, taskbar or menu covers
+    region_init(&vis);
+    region_add(&vis, damage);
+    region_subtract_above(&vis, 0, true);
+    draw_region(&vis, draw_desktop_cb, NULL);
+    prof_lap(PROF_DESKTOP, &lap);
+    
+    // Windows, bottom to top
+    for (uint32_t z = 0; z < sys->window_count; z++) {
+        Window* win = sys->z_order[z];
+        if (!window_shown(win)) continue;
+        
+        Rect body, shadow, r;
+        window_body(win, &body);
+        window_shadow(win, &shadow);
+        
+        region_init(&vis);
+        if (rect_intersect(&body, damage, &r)) region_add(&vis, &r);
+        if (rect_intersect(&shadow, damage, &r)) {
+            Region extra;
+            region_init(&extra);
+            region_add(&extra, &r);
+            region_subtract(&extra, &body);
+            for (uint32_t i = 0; i < extra.count; i++) region_add(&vis, &extra.rects[i]);
+        }
+        if (vis.count == 0) continue;
+        
+        region_subtract_above(&vis, z + 1, true);
+        draw_region(&vis, draw_window_cb, win);
+    }
+    prof_lap(PROF_WINDOWS, &lap);
+    
+    // Taskbar under the start menu
+    Rect taskbar = { 0, DESKTOP_HEIGHT, SCREEN_WIDTH, TASKBAR_HEIGHT };
+    Rect r;
+    if (rect_intersect(&taskbar, damage, &r)) {
+        region_init(&vis);
+        region_add(&vis, &r);
+        region_subtract_above(&vis, sys->window_count, false);
+        draw_region(&vis, draw_taskbar_cb, NULL);
+    }
+    prof_lap(PROF_TASKBAR, &lap);
+    
+    // Start menu is always on top
+    sys->clip = *damage;
+    draw_start_menu();
+    prof_lap(PROF_START_MENU, &lap);
+    
+    // Each damaged rect's regions are dead once it is composited
+    arena_release(&sys->frame_arena, mark);
+}
+
+// ========================================
+// Framebuffer
+// The framebuffer may be VGA mode 13h or a VBE linear framebuffer with
+// 8, 15/16, 24 or 32 bits per pixel. 8 and 32 bpp match the surfaces and
+// are presented with plain copies; 15/16 and 24 bpp pack the 32-bit
+// surface pixels (already in the mode's channel layout) on the way out.
+// ========================================
+
+static void fb_present_span_8(uint8_t* dst, const uint8_t* src, int32_t n) {
+    bulk_copy(dst, src, n);
+}
+
+static void fb_present_span_16(uint8_t* dst, const uint8_t* src, int32_t n) {
+    const uint32_t* s = (const uint32_t*)src;
+    
+    // Two pixels per dword store
+    for (; n >= 2; n -= 2) {
+        *(unaligned_u32*)dst = s[0] | (s[1] << 16);
+        dst += 4;
+        s += 2;
+    }
+    if (n) *(uint16_t*)dst = s[0];
+}
+
+static void fb_present_span_24(uint8_t* dst, const uint8_t* src, int32_t n) {
+    const uint32_t* s = (const uint32_t*)src;
+    
+    // Four pixels pack into three dword stores
+    for (; n >= 4; n -= 4) {
+        unaligned_u32* d = (unaligned_u32*)dst;
+        d[0] = s[0] | (s[1] << 24);
+        d[1] = (s[1] >> 8) | (s[2] << 16);
+        d[2] = (s[2] >> 16) | (s[3] << 8);
+        dst += 12;
+        s += 4;
+    }
+    while (n--) {
+        uint32_t p = *s++;
+        dst[0] = p;
+        dst[1] = p >> 8;
+        dst[2] = p >> 16;
+        dst += 3;
+    }
+}
+
+static void fb_present_span_32(uint8_t* dst, const uint8_t* src, int32_t n) {
+    bulk_copy(dst, src, n * 4);
+}
+
+// Scale a 6-bit DAC component to the mode's channel width and position
+static uint32_t fb_channel(uint8_t dac, uint8_t size, uint8_t position) {
+    uint32_t v = (dac << 2) | (dac >> 4);
+    return (v >> (8 - size)) << position;
+}
+
+void framebuffer_init(const BootInfo* boot) {
+    Framebuffer* fb = &sys->display.fb;
+    const VbeModeInfo* m = &boot->vbe;
+    
+    if (boot->vbe_mode) {
+        fb->base = (uint8_t*)m->framebuffer;
+        fb->width = m->width < MAX_SCREEN_WIDTH ? m->width : MAX_SCREEN_WIDTH;
+        fb->height = m->height < MAX_SCREEN_HEIGHT ? m->height : MAX_SCREEN_HEIGHT;
+        fb->pitch = m->pitch;
+        fb->bytes_per_pixel = (m->bpp + 7) / 8;
+    } else {
+        fb->base = (uint8_t*)VGA_MEMORY;
+        fb->width = VGA_WIDTH;
+        fb->height = VGA_HEIGHT;
+        fb->pitch = VGA_WIDTH;
+        fb->bytes_per_pixel = 1;
+    }
+    
+    // Indexed modes keep the hardware palette; direct color modes get the
+    // mode 13h palette packed into their channel layout
+    for (uint32_t i = 0; i < 256; i++) {
+        const uint8_t* rgb = boot->palette[i];
+        fb->palette[i] = fb->bytes_per_pixel == 1 ? i :
+            fb_channel(rgb[0], m->red_mask, m->red_position) |
+            fb_channel(rgb[1], m->green_mask, m->green_position) |
+            fb_channel(rgb[2], m->blue_mask, m->blue_position);
+    }
+    
+    // Pick the kernel tables for this mode
+    sys->blit = fb->bytes_per_pixel == 1 ? &blit_ops_8 : &blit_ops_32;
+    switch (fb->bytes_per_pixel) {
+        case 2:
+            fb->present_span = fb_present_span_16;
+            break;
+        case 3:
+            fb->present_span = fb_present_span_24;
+            break;
+        case 4:
+            fb->present_span = fb_present_span_32;
+            break;
+        default:
+            fb->present_span = fb_present_span_8;
+            break;
+    }
+    
+    simd_begin();
+    for (int32_t y = 0; y < fb->height; y++) {
+        bulk_fill(fb->base + y * fb->pitch, 0, fb->width * fb->bytes_per_pixel);
+    }
+    simd_end();
+    
+    // Surfaces are sized to the mode; without RAM for them, render into a
+    // 320x200 corner of the screen instead
+    uint32_t pages = (SCREEN_SIZE * sys->blit->bytes_per_pixel + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    sys->backbuffer = pmm_alloc_pages(pages);
+    sys->desktop_layer = pmm_alloc_pages(pages);
+    if (!sys->backbuffer || !sys->desktop_layer) {
+        if (sys->backbuffer) pmm_free_pages(sys->backbuffer, pages);
+        if (sys->desktop_layer) pmm_free_pages(sys->desktop_layer, pages);
+        
+        fb->width = VGA_WIDTH;
+        fb->height = VGA_HEIGHT;
+        pages = (SCREEN_SIZE * sys->blit->bytes_per_pixel + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        sys->backbuffer = pmm_alloc_pages(pages);
+        sys->desktop_layer = pmm_alloc_pages(pages);
+    }
+    if (!sys->backbuffer || !sys->desktop_layer) {
+        while (1) hlt();    // Nothing to draw into
+    }
+}
+
+// ========================================
+// VGA Output
+// Linear framebuffers (mode 13h or VBE) are written through the present
+// span kernels above. The optional Mode X variant unchains mode 13h into four
+// planes, which leaves room for two hardware pages that are flipped via
+// the CRTC start address.
+// ========================================
+
+static inline uint8_t vga_in_retrace(void) {
+    return inb(VGA_INPUT_STATUS) & VGA_STATUS_RETRACE;
+}
+
+// Spin until the retrace bit matches 'retrace'. Bounded by the timer so a
+// display that never reports retrace cannot hang the render loop.
+static void vga_wait_retrace_state(bool retrace) {
+    uint32_t deadline = timer_get_ticks() + VGA_RETRACE_TIMEOUT;
+    while ((vga_in_retrace() != 0) != retrace) {
+        if ((int32_t)(timer_get_ticks() - deadline) >= 0) return;
+    }
+}
+
+// Wait for the start of the next vertical blanking interval
+void vga_wait_vblank(void) {
+    vga_wait_retrace_state(false);  // Let a retrace in progress finish
+    vga_wait_retrace_state(true);
+}
+
+static inline void vga_set_plane_mask(uint8_t mask) {
+    outb(VGA_SEQ_INDEX, 0x02);      // Map mask
+    outb(VGA_SEQ_DATA, mask);
+}
+
+static inline void vga_set_read_plane(uint8_t plane) {
+    outb(VGA_GC_INDEX, 0x04);       // Read map select
+    outb(VGA_GC_DATA, plane);
+}
+
+// Copy a rect of surface pixels (src points at the rect's top-left, with
+// 'pitch' bytes per row) onto a display page
+void display_write_rect(uint8_t page, const Rect* r, const uint8_t* src, int32_t pitch) {
+    const Framebuffer* fb = &sys->display.fb;
+    
+    if (sys->display.mode != PRESENT_PAGE_FLIP) {
+        uint8_t* dst = fb->base + r->y * fb->pitch + r->x * fb->bytes_per_pixel;
+        for (int32_t j = 0; j < r->h; j++) {
+            fb->present_span(dst, src, r->w);
+            dst += fb->pitch;
+            src += pitch;
+        }
+        return;
+    }
+    
+    // Planar: pixel x lives in plane x & 3 at byte x >> 2 of its row
+    uint8_t* base = fb->base + page * MODEX_PAGE_SIZE + r->y * MODEX_PITCH;
+    for (uint8_t plane = 0; plane < 4; plane++) {
+        int32_t first = r->x + ((plane - r->x) & 3);
+        if (first >= r->x + r->w) continue;
+        
+        vga_set_plane_mask(1 << plane);
+        uint8_t* row = base;
+        const uint8_t* line = src;
+        for (int32_t j = 0; j < r->h; j++) {
+            for (int32_t x = first; x < r->x + r->w; x += 4) {
+                row[x >> 2] = line[x - r->x];
+            }
+            row += MODEX_PITCH;
+            line += pitch;
+        }
+    }
+}
+
+// Read back the surface pixels shown in a rect. A linear framebuffer
+// mirrors the backbuffer once damage is flushed, so read that instead of
+// (possibly slow, packed) video memory; Mode X pages lag behind it.
+void display_read_rect(uint8_t page, const Rect* r, uint8_t* dst, int32_t pitch) {
+    if (sys->display.mode != PRESENT_PAGE_FLIP) {
+        const uint8_t* src = pixel_at(sys->backbuffer, r->x, r->y);
+        for (int32_t j = 0; j < r->h; j++) {
+            sys->blit->copy(dst, src, r->w);
+            src += surface_pitch();
+            dst += pitch;
         }
+        return;
+    }
+    
+    const uint8_t* base = sys->display.fb.base + page * MODEX_PAGE_SIZE + r->y * MODEX_PITCH;
+    for (uint8_t plane = 0; plane < 4; plane++) {
+        int32_t first = r->x + ((plane - r->x) & 3);
+        if (first >= r->x + r->w) continue;
         
-        sys->mouse.packet_index = 0;
-        packets_processed++;
-        
-        // Check validity - bit 3 should be set for valid packets
-        if (!(sys->mouse.packet_buffer[0] & 0x08)) {
-            continue;  // Invalid packet, skip
+        vga_set_read_plane(plane);
+        const uint8_t* row = base;
+        uint8_t* line = dst;
+        for (int32_t j = 0; j < r->h; j++) {
+            for (int32_t x = first; x < r->x + r->w; x += 4) {
+                line[x - r->x] = row[x >> 2];
+            }
+            row += MODEX_PITCH;
+            line += pitch;
         }
-        
-        // Store previous button state
-        sys->mouse.buttons_prev = sys->mouse.buttons;
-        
-        // Extract button state (bits 0-2)
-        sys->mouse.buttons = sys->mouse.packet_buffer[0] & 0x07;
-        
-        // Extract movement (9-bit two's complement, but we use 8-bit signed)
-        int32_t dx = (int32_t)(int8_t)sys->mouse.packet_buffer[1];
-        int32_t dy = -(int32_t)(int8_t)sys->mouse.packet_buffer[2];  // Invert Y axis (screen Y increases downward)
-        
-        // Apply movement with sensitivity adjustment
-        sys->mouse.x += dx;
-        sys->mouse.y += dy;
-        
-        // Clamp to screen bounds
-        if (sys->mouse.x < 0) sys->mouse.x = 0;
-        if (sys->mouse.x >= SCREEN_WIDTH - 8) sys->mouse.x = SCREEN_WIDTH - 8;
-        if (sys->mouse.y < 0) sys->mouse.y = 0;
-        if (sys->mouse.y >= SCREEN_HEIGHT - 8) sys->mouse.y = SCREEN_HEIGHT - 8;
     }
 }
 
-// ========================================
-// Keyboard Driver
-// ========================================
+// Unchain mode 13h into planar Mode X (same 320x200 timing)
+static void vga_enter_mode_x(void) {
+    outb(VGA_SEQ_INDEX, 0x04);      // Memory mode: chain-4 off, odd/even off
+    outb(VGA_SEQ_DATA, (inb(VGA_SEQ_DATA) & ~0x08) | 0x04);
+    
+    outb(VGA_CRTC_INDEX, 0x14);     // Underline location: doubleword mode off
+    outb(VGA_CRTC_DATA, inb(VGA_CRTC_DATA) & ~0x40);
+    
+    outb(VGA_CRTC_INDEX, 0x17);     // Mode control: byte addressing
+    outb(VGA_CRTC_DATA, inb(VGA_CRTC_DATA) | 0x40);
+    
+    // Clear all four planes of every page
+    vga_set_plane_mask(0x0F);
+    memset((void*)VGA_MEMORY, 0, 0x10000);
+}
 
-void init_keyboard(void) {
-    sys->keyboard.head = 0;
-    sys->keyboard.tail = 0;
+static void vga_set_start_address(uint16_t addr) {
+    outb(VGA_CRTC_INDEX, 0x0C);
+    outb(VGA_CRTC_DATA, addr >> 8);
+    outb(VGA_CRTC_INDEX, 0x0D);
+    outb(VGA_CRTC_DATA, addr & 0xFF);
+}
+
+// Show 'page'. The start address is latched at the beginning of vertical
+// retrace, so write it during active display and then wait for retrace
+// before touching the page that just went off screen.
+static void vga_flip_to(uint8_t page) {
+    vga_wait_retrace_state(false);
+    vga_set_start_address(page * MODEX_PAGE_SIZE);
+    vga_wait_retrace_state(true);
 }
 
-void read_keyboard(void) {
-    uint8_t status = inb(KB_STATUS_PORT);
+void display_init(const BootInfo* boot, PresentMode mode) {
+    Display* d = &sys->display;
     
-    // Check if data is available and it's not mouse data (bit 5 = 0 for keyboard)
-    if (!(status & 0x01) || (status & 0x20)) {
-        return;  // No keyboard data or it's mouse data
+    framebuffer_init(boot);
+    
+    // Mode X page flipping only exists on top of mode 13h
+    if (mode == PRESENT_PAGE_FLIP && boot->vbe_mode) {
+        mode = PRESENT_VSYNC;
     }
     
-    uint8_t scancode = inb(KB_DATA_PORT);
+    d->mode = mode;
+    d->back_page = 0;
     
-    // Add to buffer
-    sys->keyboard.buffer[sys->keyboard.tail] = scancode;
-    sys->keyboard.tail = (sys->keyboard.tail + 1) & 0x0F;
-}
-
-uint8_t get_scancode(void) {
-    if (sys->keyboard.head == sys->keyboard.tail) {
-        return 0;  // Buffer empty
+    if (mode == PRESENT_PAGE_FLIP) {
+        vga_enter_mode_x();
+        vga_set_start_address(0);
+        d->back_page = 1;
     }
-    
-    uint8_t scancode = sys->keyboard.buffer[sys->keyboard.head];
-    sys->keyboard.head = (sys->keyboard.head + 1) & 0x0F;
-    return scancode;
 }
 
 // ========================================
-// Graphics Functions
+// Cursor Overlay
+// The cursor never enters the backbuffer. It is drawn straight onto the
+// visible page over a saved copy of the pixels beneath it, so pure mouse
+// motion is a restore plus a redraw of at most 9x9 pixels.
 // ========================================
 
-void set_pixel(int32_t x, int32_t y, uint8_t color) {
-    if (x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT) {
-        sys->backbuffer[y * SCREEN_WIDTH + x] = color;
-    }
-}
+// Cursor with its shadow baked in, SPRITE_KEY where the desktop shows through
+static uint8_t cursor_sprite[CURSOR_EXTENT][CURSOR_EXTENT];
 
-void draw_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
-    for (int32_t j = 0; j < h; j++) {
-        for (int32_t i = 0; i < w; i++) {
-            set_pixel(x + i, y + j, color);
+void cursor_init(void) {
+    memset(cursor_sprite, SPRITE_KEY, sizeof(cursor_sprite));
+    for (int32_t j = 0; j < 8; j++) {
+        for (int32_t i = 0; i < 8; i++) {
+            if (cursor_data[j][i]) cursor_sprite[j + 1][i + 1] = 0;
+        }
+    }
+    for (int32_t j = 0; j < 8; j++) {
+        for (int32_t i = 0; i < 8; i++) {
+            if (cursor_data[j][i]) cursor_sprite[j][i] = cursor_data[j][i];
         }
     }
 }
 
-void draw_rect_border(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
-    // Top and bottom
-    for (int32_t i = 0; i < w; i++) {
-        set_pixel(x + i, y, color);
-        set_pixel(x + i, y + h - 1, color);
-    }
-    // Left and right
-    for (int32_t j = 0; j < h; j++) {
-        set_pixel(x, y + j, color);
-        set_pixel(x + w - 1, y + j, color);
-    }
+// Put back the pixels the cursor covered on 'page'
+void cursor_hide(uint8_t page) {
+    CursorOverlay* c = &sys->display.cursor[page];
+    if (!c->visible) return;
+    
+    display_write_rect(page, &c->saved, c->save_under,
+                       c->saved.w * sys->blit->bytes_per_pixel);
+    c->visible = false;
 }
 
-void draw_char(int32_t x, int32_t y, char c, uint8_t color) {
-    if (c < 32 || c > 122) return;
+// Save the pixels under the cursor footprint, then draw shadow and cursor
+void cursor_show(uint8_t page, int32_t x, int32_t y) {
+    CursorOverlay* c = &sys->display.cursor[page];
+    Rect screen = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    Rect area = { x, y, CURSOR_EXTENT, CURSOR_EXTENT };
+    uint8_t image[sizeof(c->save_under)];
     
-    const uint8_t* glyph = &font_data[(uint8_t)c * 8];
+    cursor_hide(page);
+    c->x = x;
+    c->y = y;
+    if (!rect_intersect(&area, &screen, &c->saved)) return;
     
-    for (int j = 0; j < 8; j++) {
-        uint8_t row = glyph[j];
-        for (int i = 0; i < 8; i++) {
-            if (row & (0x80 >> i)) {
-                set_pixel(x + i, y + j, color);
-            }
-        }
+    int32_t pitch = c->saved.w * sys->blit->bytes_per_pixel;
+    display_read_rect(page, &c->saved, c->save_under, pitch);
+    
+    // Composite the visible part of the sprite over the saved pixels
+    memcpy(image, c->save_under, pitch * c->saved.h);
+    for (int32_t j = 0; j < c->saved.h; j++) {
+        const uint8_t* src = &cursor_sprite[c->saved.y - y + j][c->saved.x - x];
+        sys->blit->copy_transparent(image + j * pitch, src, c->saved.w);
     }
+    display_write_rect(page, &c->saved, image, pitch);
+    c->visible = true;
 }
 
-void draw_string(int32_t x, int32_t y, const char* str, uint8_t color) {
-    while (*str) {
-        draw_char(x, y, *str, color);
-        x += 8;
-        str++;
-    }
+// Page currently on screen
+static uint8_t front_page(void) {
+    return sys->display.mode == PRESENT_PAGE_FLIP ? sys->display.back_page ^ 1 : 0;
 }
 
-void draw_button_3d(int32_t x, int32_t y, int32_t w, int32_t h, uint8_t color) {
-    // Base
-    draw_rect(x, y, w, h, color);
-    
-    // Highlight (top-left)
-    draw_rect(x, y, w, 1, 15);  // Top
-    draw_rect(x, y, 1, h, 15);  // Left
-    
-    // Shadow (bottom-right)
-    draw_rect(x, y + h - 1, w, 1, 0);       // Bottom
-    draw_rect(x + w - 1, y, 1, h, 0);       // Right
+bool cursor_moved(void) {
+    const CursorOverlay* c = &sys->display.cursor[front_page()];
+    return !c->visible || c->x != sys->mouse.x || c->y != sys->mouse.y;
 }
 
 // ========================================
-// Desktop & UI Rendering
+// Presentation
 // ========================================
 
-void draw_desktop(void) {
-    // Gradient background
-    for (int y = 0; y < SCREEN_HEIGHT - 10; y++) {
-        uint8_t color = 1 + (y / 16);
-        for (int x = 0; x < SCREEN_WIDTH; x++) {
-            set_pixel(x, y, color);
-        }
+static void flush_rects(uint8_t page, const DamageList* d) {
+    for (uint32_t i = 0; i < d->count; i++) {
+        const Rect* r = &d->rects[i];
+        display_write_rect(page, r, pixel_at(sys->backbuffer, r->x, r->y), surface_pitch());
     }
 }
 
-void draw_taskbar(void) {
-    // Taskbar background
-    draw_rect(0, SCREEN_HEIGHT - 10, SCREEN_WIDTH, 10, 8);
+// Red bar across the top of the visible page (fatal exceptions)
+void display_show_fault(void) {
+    if (!sys->blit) return;
     
-    // Start button
-    draw_button_3d(2, SCREEN_HEIGHT - 8, 60, 8, 7);
-    draw_string(16, SCREEN_HEIGHT - 6, "START", 0);
+    Rect bar = { 0, 0, SCREEN_WIDTH, 4 };
+    for (int32_t y = 0; y < bar.h; y++) {
+        sys->blit->fill(pixel_at(sys->backbuffer, 0, y), color_pixel(4), bar.w);
+    }
+    display_write_rect(front_page(), &bar, sys->backbuffer, surface_pitch());
 }
 
-void draw_start_menu(void) {
-    if (!sys->start_menu_open) return;
-    
-    // Menu background with shadow
-    draw_rect(4, 102, 80, 85, 0);  // Shadow
-    draw_rect(2, 100, 80, 85, 7);  // Menu
-    draw_rect_border(2, 100, 80, 85, 15);
-    
-    // Menu items
-    draw_string(10, 110, "Programs", 0);
-    draw_string(10, 125, "Documents", 0);
-    draw_string(10, 140, "Settings", 0);
-    draw_string(10, 155, "Hypervisor", 0);
-    draw_string(10, 170, "Shutdown", 0);
+static void damage_merge(DamageList* into, const DamageList* from) {
+    for (uint32_t i = 0; i < from->count; i++) {
+        const Rect* r = &from->rects[i];
+        damage_add(into, r->x, r->y, r->w, r->h);
+    }
 }
 
-void draw_desktop_icon(int32_t x, int32_t y, uint8_t type, const char* name) {
-    // Icon background
-    draw_rect(x, y, 32, 32, type == 0 ? 9 : (type == 1 ? 14 : 15));
+// Page flip: bring the back page up to date, put the cursor on it and make
+// it visible. The back page last received pixels two frames ago, so it
+// also gets everything flushed to the other page since then.
+static void present_page_flip(void) {
+    Display* d = &sys->display;
+    uint8_t back = d->back_page;
     
-    // Icon details (simplified)
-    if (type == 0) {  // Computer
-        draw_rect(x + 6, y + 4, 20, 16, 15);
-        draw_rect(x + 8, y + 6, 16, 12, 9);
-        draw_rect(x + 12, y + 20, 8, 8, 15);
-    } else if (type == 1) {  // Folder
-        draw_rect(x + 4, y + 10, 24, 18, 14);
-        draw_rect(x + 4, y + 6, 12, 4, 14);
-    } else {  // Document
-        draw_rect(x + 8, y + 4, 16, 24, 15);
-        draw_rect(x + 10, y + 10, 12, 1, 0);
-        draw_rect(x + 10, y + 14, 12, 1, 0);
-        draw_rect(x + 10, y + 18, 12, 1, 0);
-    }
+    cursor_hide(back);
     
-    // Icon label
-    draw_string(x + 2, y + 34, name, 15);
-}
-
-void draw_desktop_icons(void) {
-    draw_desktop_icon(10, 10, 0, "My PC");
-    draw_desktop_icon(10, 60, 1, "Files");
-    draw_desktop_icon(10, 110, 2, "Notes");
+    DamageList* stale = &d->stale[back];
+    damage_merge(stale, &sys->damage);
+    damage_merge(stale, &sys->present);
+    flush_rects(back, stale);
+    stale->count = 0;
+    
+    damage_merge(&d->stale[back ^ 1], &sys->damage);
+    damage_merge(&d->stale[back ^ 1], &sys->present);
+    
+    cursor_show(back, sys->mouse.x, sys->mouse.y);
+    vga_flip_to(back);
+    d->back_page = back ^ 1;
 }
 
-void draw_window(Window* win) {
-    if (!win->visible || win->minimized) return;
+// Copy only the damaged regions of the backbuffer to VGA memory. A flush
+// under the cursor would overwrite it and stale its save-under, so the
+// cursor is lifted first and re-saved afterwards.
+void flip_buffer(void) {
+    CursorOverlay* c = &sys->display.cursor[0];
     
-    // Shadow
-    draw_rect(win->x + 2, win->y + 2, win->width, win->height, 0);
+    // Do the copy inside the blanking interval so it does not tear
+    if (sys->display.mode == PRESENT_VSYNC) {
+        vga_wait_vblank();
+    }
     
-    // Title bar
-    draw_rect(win->x, win->y, win->width, 12, 8);
+    if (c->visible &&
+        (damage_overlaps(&sys->damage, &c->saved) ||
+         damage_overlaps(&sys->present, &c->saved))) {
+        cursor_hide(0);
+    }
     
-    // Window body
-    draw_rect(win->x, win->y + 12, win->width, win->height - 12, win->color);
+    flush_rects(0, &sys->damage);
+    flush_rects(0, &sys->present);
+}
+
+// Re-render and flush the damaged regions; a static screen costs nothing
+// and pure cursor motion only touches the overlay
+void render_frame(void) {
+    bool scene_changed = sys->damage.count > 0 || sys->present.count > 0;
+    bool cursor_changed = cursor_moved();
+    uint64_t start = rdtsc();
     
-    // Border
-    draw_rect_border(win->x, win->y, win->width, win->height, 15);
+    sys->animation_requested = false;
     
-    // Close button
-    draw_button_3d(win->x + win->width - 14, win->y + 2, 10, 8, 12);
-    draw_string(win->x + win->width - 11, win->y + 4, "X", 15);
+    // One SIMD region covers composition and the flush
+    simd_begin();
     
-    // Title
-    draw_string(win->x + 5, win->y + 3, win->title, 15);
+    for (uint32_t i = 0; i < sys->damage.count; i++) {
+        compose_rect(&sys->damage.rects[i]);
+    }
+    reset_clip();
     
-    // Special content for hypervisor window
-    if (strcmp(win->title, "Hypervisor Status") == 0) {
-        draw_string(win->x + 10, win->y + 20, "VT-x: ", 15);
-        if (vtx_supported) {
-            draw_string(win->x + 50, win->y + 20, "Supported", 10);
-        } else {
-            draw_string(win->x + 50, win->y + 20, "Not Supported", 12);
+    // Page flipping moves the cursor as part of the flip
+    uint64_t lap = rdtsc();
+    if (sys->display.mode == PRESENT_PAGE_FLIP) {
+        if (scene_changed || cursor_changed) {
+            present_page_flip();
         }
-        
-        draw_string(win->x + 10, win->y + 35, "EPT: Initialized", 10);
-        draw_string(win->x + 10, win->y + 50, "VMCS: Ready", 10);
-        draw_string(win->x + 10, win->y + 65, "I/O Trap: Enabled", 10);
-    }
-}
-
-void draw_windows(void) {
-    for (uint32_t i = 0; i < sys->window_count; i++) {
-        draw_window(&sys->windows[i]);
-    }
-}
-
-void draw_mouse(void) {
-    // Draw shadow
-    for (int j = 0; j < 8; j++) {
-        for (int i = 0; i < 8; i++) {
-            if (cursor_data[j][i] != 0) {
-                set_pixel(sys->mouse.x + i + 1, sys->mouse.y + j + 1, 0);
-            }
+        prof_lap(PROF_FLUSH, &lap);
+    } else {
+        if (scene_changed) {
+            flip_buffer();
         }
-    }
-    
-    // Draw cursor
-    for (int j = 0; j < 8; j++) {
-        for (int i = 0; i < 8; i++) {
-            if (cursor_data[j][i] != 0) {
-                set_pixel(sys->mouse.x + i, sys->mouse.y + j, cursor_data[j][i]);
-            }
+        prof_lap(PROF_FLUSH, &lap);
+        if (cursor_moved()) {
+            cursor_show(0, sys->mouse.x, sys->mouse.y);
         }
+        prof_lap(PROF_CURSOR, &lap);
     }
-}
-
-void flip_buffer(void) {
-    memcpy((void*)VGA_MEMORY, sys->backbuffer, SCREEN_SIZE);
+    simd_end();
+    
+    sys->damage.count = 0;
+    sys->present.count = 0;
+    prof_lap(PROF_RENDER, &start);
+    prof_frame_end();
 }
 
 // ========================================
 // Window Management
 // ========================================
 
+// Window footprint including its 2-pixel drop shadow
+void mark_window_dirty(Window* win) {
+    mark_dirty(win->x, win->y, win->width + 2, win->height + 2);
+}
+
+void set_start_menu(bool open) {
+    if (sys->start_menu_open == open) return;
+    sys->start_menu_open = open;
+    mark_dirty(START_MENU_X, START_MENU_Y, START_MENU_W, START_MENU_H);
+}
+
+static SlabCache window_cache = SLAB_CACHE(sizeof(Window));
+
+// Window count is bounded by free memory: z_order doubles when full
 void create_window(int32_t x, int32_t y, int32_t w, int32_t h, 
                    uint8_t color, const char* title) {
-    if (sys->window_count >= 10) return;
+    if (sys->window_count == sys->window_capacity) {
+        uint32_t capacity = sys->window_capacity ? sys->window_capacity * 2 : WINDOW_ORDER_INITIAL;
+        Window** order = kmalloc(capacity * sizeof(Window*));
+        if (!order) return;
+        memcpy(order, sys->z_order, sys->window_count * sizeof(Window*));
+        kfree(sys->z_order);
+        sys->z_order = order;
+        sys->window_capacity = capacity;
+    }
     
-    Window* win = &sys->windows[sys->window_count];
+    Window* win = cache_alloc(&window_cache);
+    if (!win) return;
     win->x = x;
     win->y = y;
     win->width = w;
@@ -698,7 +3582,45 @@ void create_window(int32_t x, int32_t y, int32_t w, int32_t h,
     win->minimized = 0;
     strcpy(win->title, title);
     
-    sys->window_count++;
+    sys->z_order[sys->window_count++] = win;  // New windows open on top
+    mark_window_dirty(win);
+}
+
+// Move a window to the top of the z-order
+void raise_window(Window* win) {
+    uint32_t pos = 0;
+    while (pos < sys->window_count && sys->z_order[pos] != win) pos++;
+    if (pos >= sys->window_count - 1) return;  // Already on top
+    
+    for (; pos < sys->window_count - 1; pos++) {
+        sys->z_order[pos] = sys->z_order[pos + 1];
+    }
+    sys->z_order[pos] = win;
+    mark_window_dirty(win);
+}
+
+// F12: show or hide the performance overlay, creating it the first time
+void toggle_perf_overlay(void) {
+    Window* win = sys->profiler.overlay;
+    
+    if (!win) {
+        uint32_t count = sys->window_count;
+        create_window(SCREEN_WIDTH - 260, DESKTOP_HEIGHT - 128, 250, 118, 0, PROF_OVERLAY_TITLE);
+        if (sys->window_count == count) return;
+        sys->profiler.overlay = sys->z_order[count];
+        return;
+    }
+    
+    win->visible = !win->visible;
+    if (win->visible) raise_window(win);
+    mark_window_dirty(win);
+}
+
+// Redraw the open overlay every PROF_REFRESH_TICKS
+void update_perf_overlay(void) {
+    if (!prof_overlay_due()) return;
+    sys->profiler.refresh_tick = timer_ticks;
+    mark_window_dirty(sys->profiler.overlay);
 }
 
 bool point_in_rect(int32_t px, int32_t py, int32_t x, int32_t y, 
@@ -712,45 +3634,64 @@ void handle_click(void) {
     
     // Check start button
     if (point_in_rect(mx, my, 2, SCREEN_HEIGHT - 8, 60, 8)) {
-        sys->start_menu_open = !sys->start_menu_open;
+        set_start_menu(!sys->start_menu_open);
         return;
     }
     
     // Check start menu items
     if (sys->start_menu_open) {
-        if (point_in_rect(mx, my, 2, 100, 80, 85)) {
+        int32_t y = START_MENU_Y;
+        if (point_in_rect(mx, my, 2, y, 80, 85)) {
             // Programs
-            if (point_in_rect(mx, my, 2, 105, 80, 10)) {
+            if (point_in_rect(mx, my, 2, y + 5, 80, 10)) {
                 create_window(80, 40, 200, 120, 9, "Programs");
-                sys->start_menu_open = false;
+                set_start_menu(false);
                 return;
             }
             // Documents
-            if (point_in_rect(mx, my, 2, 120, 80, 10)) {
+            if (point_in_rect(mx, my, 2, y + 20, 80, 10)) {
                 create_window(100, 60, 220, 140, 14, "Documents");
-                sys->start_menu_open = false;
+                set_start_menu(false);
                 return;
             }
             // Settings
-            if (point_in_rect(mx, my, 2, 135, 80, 10)) {
+            if (point_in_rect(mx, my, 2, y + 35, 80, 10)) {
                 create_window(120, 80, 180, 100, 15, "Settings");
-                sys->start_menu_open = false;
+                set_start_menu(false);
                 return;
             }
             // Hypervisor
-            if (point_in_rect(mx, my, 2, 150, 80, 10)) {
+            if (point_in_rect(mx, my, 2, y + 50, 80, 10)) {
                 create_window(60, 40, 250, 150, 11, "Hypervisor Status");
-                sys->start_menu_open = false;
+                set_start_menu(false);
                 return;
             }
             // Shutdown
-            if (point_in_rect(mx, my, 2, 165, 80, 10)) {
+            if (point_in_rect(mx, my, 2, y + 65, 80, 10)) {
                 // Shutdown (halt)
                 cli();
                 while(1) hlt();
             }
         }
-        sys->start_menu_open = false;
+        set_start_menu(false);
+        return;
+    }
+    
+    // Check windows, topmost first - clicking anywhere raises the window,
+    // the title bar also starts a drag
+    for (int32_t z = sys->window_count - 1; z >= 0; z--) {
+        Window* win = sys->z_order[z];
+        if (!win->visible || win->minimized) continue;
+        if (!point_in_rect(mx, my, win->x, win->y, win->width, win->height)) continue;
+        
+        raise_window(win);
+        sys->active_window = win;
+        
+        if (point_in_rect(mx, my, win->x, win->y, win->width, 12)) {
+            sys->dragging = true;
+            sys->drag_offset_x = mx - win->x;
+            sys->drag_offset_y = my - win->y;
+        }
         return;
     }
     
@@ -767,26 +3708,60 @@ void handle_click(void) {
         create_window(120, 80, 180, 100, 15, "Notepad");
         return;
     }
+}
+
+// Fast move: the window body is already rendered in the backbuffer, so
+// shift it there and only repaint what the move exposed plus the new
+// shadow strips. Requires the window to be the topmost layer at both
+// positions and its pixels to be up to date; returns false otherwise.
+bool move_window_pixels(Window* win, int32_t old_x, int32_t old_y) {
+    Rect old_body = { old_x, old_y, win->width, win->height };
+    Rect old_shadow = { old_x + 2, old_y + 2, win->width, win->height };
+    Rect body, shadow, overlap;
+    window_body(win, &body);
+    window_shadow(win, &shadow);
     
-    // Check window title bars (for dragging)
-    for (int32_t i = sys->window_count - 1; i >= 0; i--) {
-        Window* win = &sys->windows[i];
-        if (!win->visible || win->minimized) continue;
-        
-        if (point_in_rect(mx, my, win->x, win->y, win->width, 12)) {
-            sys->active_window = i;
-            sys->dragging = true;
-            sys->drag_offset_x = mx - win->x;
-            sys->drag_offset_y = my - win->y;
-            return;
+    if (sys->z_order[sys->window_count - 1] != sys->active_window) return false;
+    if (damage_overlaps(&sys->damage, &old_body)) return false;
+    
+    // The taskbar sits above every window, so a body reaching under it
+    // holds taskbar pixels in the backbuffer
+    Rect taskbar = { 0, DESKTOP_HEIGHT, SCREEN_WIDTH, TASKBAR_HEIGHT };
+    if (rect_intersect(&taskbar, &old_body, &overlap)) return false;
+    
+    if (sys->start_menu_open) {
+        Rect menu = { START_MENU_X, START_MENU_Y, START_MENU_W, START_MENU_H };
+        if (rect_intersect(&menu, &old_body, &overlap) ||
+            rect_intersect(&menu, &old_shadow, &overlap) ||
+            rect_intersect(&menu, &shadow, &overlap)) {
+            return false;
         }
     }
+    
+    copy_rect(&old_body, body.x, body.y);
+    mark_present(body.x, body.y, body.w, body.h);
+    
+    // Old footprint and new shadow, minus the body that now covers them
+    Region exposed;
+    region_init(&exposed);
+    region_add(&exposed, &old_body);
+    region_add(&exposed, &old_shadow);
+    region_add(&exposed, &shadow);
+    region_subtract(&exposed, &body);
+    for (uint32_t i = 0; i < exposed.count; i++) {
+        const Rect* r = &exposed.rects[i];
+        mark_dirty(r->x, r->y, r->w, r->h);
+    }
+    return true;
 }
 
 void handle_drag(void) {
-    if (!sys->dragging || sys->active_window < 0) return;
+    if (!sys->dragging || !sys->active_window) return;
+    
+    Window* win = sys->active_window;
+    int32_t old_x = win->x;
+    int32_t old_y = win->y;
     
-    Window* win = &sys->windows[sys->active_window];
     win->x = sys->mouse.x - sys->drag_offset_x;
     win->y = sys->mouse.y - sys->drag_offset_y;
     
@@ -797,25 +3772,49 @@ void handle_drag(void) {
         win->x = SCREEN_WIDTH - win->width;
     if (win->y + win->height > SCREEN_HEIGHT - 10) 
         win->y = SCREEN_HEIGHT - 10 - win->height;
+    
+    if (win->x == old_x && win->y == old_y) return;
+    
+    if (!move_window_pixels(win, old_x, old_y)) {
+        // Damage the old and new footprints
+        mark_dirty(old_x, old_y, win->width + 2, win->height + 2);
+        mark_window_dirty(win);
+    }
 }
 
 // ========================================
 // Input Processing
 // ========================================
 
+void handle_mouse_buttons(void) {
+    // Handle mouse clicks (with debouncing)
+    if ((sys->mouse.buttons & 1) && !(sys->mouse.buttons_prev & 1)) {
+        // New click
+        handle_click();
+    } else if ((sys->mouse.buttons & 1) && (sys->mouse.buttons_prev & 1)) {
+        // Dragging
+        handle_drag();
+    } else {
+        // Released
+        sys->dragging = false;
+    }
+}
+
+// Drain everything the IRQ handlers queued since the last frame
 void process_input(void) {
-    // Read mouse
-    read_mouse();
-    
-    // Read keyboard
-    read_keyboard();
+    // Process mouse - button logic runs per packet so short clicks survive
+    MouseEvent ev;
+    while (get_mouse_event(&ev)) {
+        apply_mouse_event(&ev);
+        handle_mouse_buttons();
+    }
     
     // Process keyboard
-    uint8_t scancode = get_scancode();
-    if (scancode) {
+    uint8_t scancode;
+    while ((scancode = get_scancode())) {
         // ESC - Toggle start menu
         if (scancode == 0x01) {
-            sys->start_menu_open = !sys->start_menu_open;
+            set_start_menu(!sys->start_menu_open);
         }
         // Arrow keys disabled - use mouse only
         /*
@@ -829,18 +3828,9 @@ void process_input(void) {
             handle_click();
             sys->mouse.buttons = 0;
         }
-    }
-    
-    // Handle mouse clicks (with debouncing)
-    if ((sys->mouse.buttons & 1) && !(sys->mouse.buttons_prev & 1)) {
-        // New click
-        handle_click();
-    } else if ((sys->mouse.buttons & 1) && (sys->mouse.buttons_prev & 1)) {
-        // Dragging
-        handle_drag();
-    } else {
-        // Released
-        sys->dragging = false;
+        else if (scancode == SCANCODE_F12) {
+            toggle_perf_overlay();
+        }
     }
 }
 
@@ -1024,12 +4014,16 @@ void get_vmx_info(void) {
     vmcs_revision_id = vmx_basic & 0x7FFFFFFF;
 }
 
+// VMCS and I/O bitmap pages, one set per VM
+static SlabCache vm_page_cache = SLAB_CACHE(PAGE_SIZE);
+
 // Allocate VMCS page (must be 4KB aligned)
 vmcs_t* alloc_vmcs(void) {
-    // Simple allocation from a fixed address (should use proper memory management)
-    static vmcs_t vmcs __attribute__((aligned(4096)));
-    vmcs.revision_id = vmcs_revision_id;
-    return &vmcs;
+    vmcs_t* vmcs = cache_alloc(&vm_page_cache);
+    if (!vmcs) return NULL;
+    memset(vmcs, 0, sizeof(vmcs_t));
+    vmcs->revision_id = vmcs_revision_id;
+    return vmcs;
 }
 
 // VM exit handler
@@ -1156,19 +4150,6 @@ void handle_msr_exit(void) {
     }
 }
 
-// MSR access functions
-uint64_t read_msr(uint32_t msr) {
-    uint32_t low, high;
-    __asm__ volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
-    return ((uint64_t)high << 32) | low;
-}
-
-void write_msr(uint32_t msr, uint64_t value) {
-    uint32_t low = value & 0xFFFFFFFF;
-    uint32_t high = value >> 32;
-    __asm__ volatile ("wrmsr" : : "a"(low), "d"(high), "c"(msr));
-}
-
 // Setup VMCS for basic VM
 void setup_vmcs(vmcs_t* vmcs, guest_regs_t* guest) {
     vmptrld((uint64_t)vmcs);
@@ -1205,6 +4186,7 @@ void setup_vmcs(vmcs_t* vmcs, guest_regs_t* guest) {
 void launch_minimal_vm(void) {
     // Allocate VMCS
     vmcs_t* vmcs = alloc_vmcs();
+    if (!vmcs) return;
     
     // Setup guest registers (minimal 16-bit real mode like setup)
     guest_regs_t guest = {
@@ -1268,17 +4250,27 @@ uint64_t* ept_pdpt;
 uint64_t* ept_pd;
 uint64_t* ept_pt;
 
+static SlabCache ept_table_cache = SLAB_CACHE(PAGE_SIZE);
+
+static uint64_t* alloc_ept_table(void) {
+    uint64_t* table = cache_alloc(&ept_table_cache);
+    if (table) memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
 void init_ept(void) {
-    // Allocate page-aligned tables (simplified - should use proper allocation)
-    static uint64_t pml4[512] __attribute__((aligned(4096))) = {0};
-    static uint64_t pdpt[512] __attribute__((aligned(4096))) = {0};
-    static uint64_t pd[512] __attribute__((aligned(4096))) = {0};
-    static uint64_t pt[512] __attribute__((aligned(4096))) = {0};
-    
-    ept_pml4 = pml4;
-    ept_pdpt = pdpt;
-    ept_pd = pd;
-    ept_pt = pt;
+    ept_pml4 = alloc_ept_table();
+    ept_pdpt = alloc_ept_table();
+    ept_pd = alloc_ept_table();
+    ept_pt = alloc_ept_table();
+    if (!ept_pml4 || !ept_pdpt || !ept_pd || !ept_pt) {
+        cache_free(&ept_table_cache, ept_pml4);
+        cache_free(&ept_table_cache, ept_pdpt);
+        cache_free(&ept_table_cache, ept_pd);
+        cache_free(&ept_table_cache, ept_pt);
+        ept_pml4 = ept_pdpt = ept_pd = ept_pt = NULL;
+        return;
+    }
     
     // Setup identity mapping for first 2MB
     // PML4[0] -> PDPT
@@ -1313,8 +4305,13 @@ void setup_vmcs_features(void) {
     vmwrite(0x0000201C, get_eptp());  // EPT pointer
     
     // Setup I/O bitmap for trapping
-    static uint8_t io_bitmap_a[4096] __attribute__((aligned(4096)));
-    static uint8_t io_bitmap_b[4096] __attribute__((aligned(4096)));
+    uint8_t* io_bitmap_a = cache_alloc(&vm_page_cache);
+    uint8_t* io_bitmap_b = cache_alloc(&vm_page_cache);
+    if (!io_bitmap_a || !io_bitmap_b) {
+        cache_free(&vm_page_cache, io_bitmap_a);
+        cache_free(&vm_page_cache, io_bitmap_b);
+        return;
+    }
     
     // Initialize I/O bitmaps (trap all I/O initially)
     memset(io_bitmap_a, 0xFF, 4096);
@@ -1343,7 +4340,7 @@ void setup_vmcs_features(void) {
 void handle_port_out(uint16_t port, uint32_t value, uint8_t size) {
     switch (port) {
         case 0x3F8:  // COM1 data
-            // Serial output - could implement later
+            serial_putc((char)value);
             break;
         case 0x3F9:  // COM1 interrupt enable
             break;
@@ -1369,50 +4366,90 @@ uint32_t handle_port_in(uint16_t port, uint8_t size) {
     }
 }
 
-void kernel_main(void) {
+void kernel_main(const BootInfo* boot) {
     // Initialize system state
     sys = (SystemState*)system_memory;
     memset(sys, 0, sizeof(SystemState));
+    serial_init();
+    boot_timeline_init(boot);
+    
+    // Screen geometry and surfaces come first, the mouse centers on them
+    pmm_init(boot);
+    arena_init(&sys->frame_arena, FRAME_ARENA_SIZE);
+    boot_mark("memory");
+    simd_init();
+    display_init(boot, DEFAULT_PRESENT_MODE);
+    boot_mark("display");
+    paging_init();
+    boot_mark("paging");
+    cursor_init();
+    sys->target = sys->backbuffer;
+    reset_clip();
     
     // Initialize hardware
     cli();
     init_pic();
+    init_idt();
+    boot_mark("pic, idt");
+    sampler_init();
+    init_timer();
     init_keyboard();
+    boot_mark("timer, kbd");
     init_mouse();
-    // Note: Interrupts disabled - using polling for input
+    boot_mark("mouse");
+    
+    // Ticks and input now arrive through IRQ0/IRQ1/IRQ12
+    sti();
+    tsc_calibration_start();
     
     // Initialize hypervisor foundation
     if (!init_hypervisor_foundation()) {
         // Continue as regular OS
     }
+    boot_mark("hypervisor");
     
     // Clear backbuffer
-    memset(sys->backbuffer, 0, SCREEN_SIZE);
+    simd_begin();
+    bulk_fill(sys->backbuffer, 0, SCREEN_SIZE * sys->blit->bytes_per_pixel);
+    simd_end();
     
     // Create initial window
     create_window(60, 40, 200, 120, 9, "Welcome to Bucket OS");
+    boot_mark("desktop");
+    
+    // Rate measured over the steps since sti(), then the timeline
+    // goes out over serial and into its own window
+    tsc_calibration_finish();
+    boot_timeline_dump();
+    int32_t timeline_h = 46 + boot_timeline.count * 10;
+    if (timeline_h > DESKTOP_HEIGHT - 8) timeline_h = DESKTOP_HEIGHT - 8;
+    create_window(SCREEN_WIDTH - 230, 4, 220, timeline_h, 1, BOOT_TIMELINE_TITLE);
+    
+    // First frame paints everything
+    mark_screen_dirty();
+    sys->frame_epoch = timer_get_ticks();
     
     // Main loop
     while (1) {
-        // Clear backbuffer
-        memset(sys->backbuffer, 0, SCREEN_SIZE);
+        // Transient geometry from the last pass goes in one go
+        arena_reset(&sys->frame_arena);
         
-        // Process input
+        // Process input - marks damage for anything it changes
+        uint64_t lap = rdtsc();
         process_input();
+        prof_lap(PROF_INPUT, &lap);
+        update_perf_overlay();
+        sampler_drain();
         
-        // Render everything
-        draw_desktop();
-        draw_desktop_icons();
-        draw_windows();
-        draw_taskbar();
-        draw_start_menu();
-        draw_mouse();
-        
-        // Flip to screen
-        flip_buffer();
-        
-        // Simple delay (should use timer interrupt in real implementation)
-        for (volatile int i = 0; i < 50000; i++);
+        if (frame_pending()) {
+            // Render and flush only what changed, then sleep (HLT) until
+            // the next frame slot so bursts of input stay at FRAME_HZ
+            render_frame();
+            frame_wait();
+        } else {
+            // Nothing invalid - no rendering until input arrives
+            wait_for_input();
+        }
     }
     
     // Should never return
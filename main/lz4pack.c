@@ -0,0 +1,177 @@
+// ========================================
+// Host-side kernel packer
+// Compresses kernel.bin into an LZ4 block and appends it to the
+// unlz4.asm stub, filling in the stub's header (image size in sectors,
+// payload bytes). The result boots like kernel.bin but takes fewer
+// sectors to read. The block is decoded again here before anything is
+// written, so a packer bug fails the build instead of the boot.
+// Usage: lz4pack unlz4.bin kernel.bin kernel.img
+// ========================================
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTOR_SIZE 512
+#define KERNEL_MAX_SIZE (0x80000 - 0x10000)    // Load address up to the stack
+#define STUB_IMAGE_SECTORS 4                    // Header offsets in the stub
+#define STUB_PAYLOAD_SIZE 8
+
+// LZ4 block format limits
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     // The block ends with at least this many literals
+#define MF_LIMIT 12         // No match may start closer than this to the end
+#define MAX_OFFSET 65535
+#define HASH_BITS 16
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// One sequence; match_len == 0 writes the final literals-only sequence
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* lit, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= MIN_MATCH;
+    *token |= (uint8_t)(match_len < 15 ? match_len : 15);
+    if (match_len >= 15) op = put_length(op, match_len - 15);
+    return op;
+}
+
+// Greedy single-probe hash matcher; dst needs n + n / 255 + 16 bytes
+static size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst) {
+    static uint32_t table[1 << HASH_BITS];     // Position + 1 of the last 4-byte hit
+    uint8_t* op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + MF_LIMIT < n) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip + 1;
+        if (!ref-- || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        size_t len = MIN_MATCH;
+        while (ip + len < n - LAST_LITERALS && src[ref + len] == src[ip + len]) len++;
+        op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
+
+// Reference decoder, mirrors the loop in unlz4.asm
+static size_t lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    const uint8_t* end = src + n;
+    size_t op = 0;
+
+    while (src < end) {
+        uint8_t token = *src++;
+        size_t len = token >> 4;
+        if (len == 15) {
+            do len += *src; while (*src++ == 255);
+        }
+        if (op + len > cap || src + len > end) return 0;
+        memcpy(dst + op, src, len);
+        src += len;
+        op += len;
+        if (src >= end) break;
+
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        len = token & 15;
+        if (len == 15) {
+            do len += *src; while (*src++ == 255);
+        }
+        len += MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > cap) return 0;
+        for (size_t i = 0; i < len; i++, op++) dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = malloc(*size ? *size : 1);
+    if (data && fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s unlz4.bin kernel.bin kernel.img\n", argv[0]);
+        return 1;
+    }
+
+    size_t stub_size, kernel_size;
+    uint8_t* stub = read_file(argv[1], &stub_size);
+    uint8_t* kernel = read_file(argv[2], &kernel_size);
+    if (!stub || !kernel) {
+        fprintf(stderr, "lz4pack: cannot read %s\n", stub ? argv[2] : argv[1]);
+        return 1;
+    }
+    if (stub_size < STUB_PAYLOAD_SIZE + 4 || kernel_size == 0 || kernel_size > KERNEL_MAX_SIZE) {
+        fprintf(stderr, "lz4pack: bad stub or kernel size\n");
+        return 1;
+    }
+
+    uint8_t* packed = malloc(kernel_size + kernel_size / 255 + 16);
+    uint8_t* check = malloc(kernel_size);
+    size_t packed_size = lz4_compress(kernel, kernel_size, packed);
+    if (lz4_decompress(packed, packed_size, check, kernel_size) != kernel_size ||
+        memcmp(check, kernel, kernel_size)) {
+        fprintf(stderr, "lz4pack: round trip mismatch\n");
+        return 1;
+    }
+
+    uint32_t image_size = (uint32_t)(stub_size + packed_size);
+    uint32_t sectors = (image_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint32_t payload = (uint32_t)packed_size;
+    memcpy(stub + STUB_IMAGE_SECTORS, &sectors, 4);
+    memcpy(stub + STUB_PAYLOAD_SIZE, &payload, 4);
+
+    FILE* out = fopen(argv[3], "wb");
+    if (!out || fwrite(stub, 1, stub_size, out) != stub_size ||
+        fwrite(packed, 1, packed_size, out) != packed_size || fclose(out)) {
+        fprintf(stderr, "lz4pack: cannot write %s\n", argv[3]);
+        return 1;
+    }
+
+    printf("  Packed kernel: %zu -> %u bytes (%u sectors)\n", kernel_size, image_size, sectors);
+    return 0;
+}
@@ -0,0 +1,285 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+
+// ========================================
+// Block memory primitives
+// Shared by the kernel (memset/memcpy/memmove) and the host benchmark.
+// Include types.h (kernel) or <stdint.h>/<stddef.h> (host) first.
+// ========================================
+
+// Size classes: byte loops below MEM_SMALL_SIZE, plain dword loops up to
+// MEM_LARGE_SIZE, rep-string instructions beyond (their startup cost only
+// pays off on longer runs)
+#define MEM_SMALL_SIZE 16
+#define MEM_LARGE_SIZE 256
+
+static inline void mem_fill_bytes(uint8_t* d, uint8_t c, size_t n) {
+    while (n--) {
+        *d++ = c;
+    }
+}
+
+static inline void mem_copy_bytes(uint8_t* d, const uint8_t* s, size_t n) {
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+// Byte stores up to dword alignment, dword stores for the body, then the tail
+static inline void mem_fill(void* dest, uint8_t c, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+
+    if (n < MEM_SMALL_SIZE) {
+        mem_fill_bytes(d, c, n);
+        return;
+    }
+
+    size_t head = (4 - ((size_t)d & 3)) & 3;
+    mem_fill_bytes(d, c, head);
+    d += head;
+    n -= head;
+
+    size_t dwords = n >> 2;
+    uint32_t pattern = c * 0x01010101u;
+    if (n < MEM_LARGE_SIZE) {
+        uint32_t* d32 = (uint32_t*)d;
+        while (dwords--) {
+            *d32++ = pattern;
+        }
+        d = (uint8_t*)d32;
+    } else {
+        __asm__ volatile ("rep stosl"
+                          : "+D"(d), "+c"(dwords)
+                          : "a"(pattern)
+                          : "memory");
+    }
+
+    mem_fill_bytes(d, c, n & 3);
+}
+
+// Store 'count' copies of a 32-bit pattern (wide pixel fills)
+static inline void mem_fill32(void* dest, uint32_t value, size_t count) {
+    __asm__ volatile ("rep stosl"
+                      : "+D"(dest), "+c"(count)
+                      : "a"(value)
+                      : "memory");
+}
+
+// Align the destination, copy the body by dwords, then the tail bytes
+static inline void mem_copy(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if (n < MEM_SMALL_SIZE) {
+        mem_copy_bytes(d, s, n);
+        return;
+    }
+
+    size_t head = (4 - ((size_t)d & 3)) & 3;
+    mem_copy_bytes(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t dwords = n >> 2;
+    size_t tail = n & 3;
+    if (n < MEM_LARGE_SIZE) {
+        uint32_t* d32 = (uint32_t*)d;
+        const uint32_t* s32 = (const uint32_t*)s;
+        while (dwords--) {
+            *d32++ = *s32++;
+        }
+        mem_copy_bytes((uint8_t*)d32, (const uint8_t*)s32, tail);
+        return;
+    }
+
+    __asm__ volatile ("rep movsl\n\t"
+                      "mov %3, %2\n\t"
+                      "rep movsb"
+                      : "+D"(d), "+S"(s), "+c"(dwords)
+                      : "r"(tail)
+                      : "memory");
+}
+
+// Overlap-safe copy: forward when dest is below src, otherwise run the
+// string instructions backwards (DF=1) from the end of the buffers
+static inline void mem_move(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if (d == s || n == 0) return;
+
+    if (d < s || d >= s + n) {
+        mem_copy(d, s, n);
+        return;
+    }
+
+    // Walk back from the end until the destination is dword aligned
+    d += n;
+    s += n;
+    while (n && ((size_t)d & 3)) {
+        *--d = *--s;
+        n--;
+    }
+
+    size_t dwords = n >> 2;
+    size_t tail = n & 3;
+    d -= 4;
+    s -= 4;
+    __asm__ volatile ("std\n\t"
+                      "rep movsl\n\t"
+                      "cld"
+                      : "+D"(d), "+S"(s), "+c"(dwords)
+                      :
+                      : "memory");
+
+    // Pointers now sit one dword below the last copied block
+    d += 4;
+    s += 4;
+    while (tail--) {
+        *--d = *--s;
+    }
+}
+
+#ifdef USE_SSE2
+// ========================================
+// SSE2 streaming variants
+// 16-byte non-temporal stores (movntdq) bypass the cache, which suits
+// large clears and copies into memory that is not read back soon, such
+// as video memory. The caller must own the SSE register state (the
+// kernel brackets these with simd_begin/simd_end). Each ends with an
+// sfence so the stores are ordered before anything that follows.
+// ========================================
+
+// Below this many bytes the alignment work outweighs the streaming gain
+#define MEM_STREAM_MIN_SIZE 512
+
+// The kernel is built without SSE, so the compiler never allocates xmm
+// registers there (and refuses xmm clobbers); host builds must be told
+#ifdef __SSE__
+#define MEM_XMM_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3",
+#else
+#define MEM_XMM_CLOBBERS
+#endif
+
+// Store 'blocks' 16-byte copies of a dword pattern; d is 16-byte aligned
+static inline uint8_t* mem_stream_fill16(uint8_t* d, uint32_t pattern, size_t blocks) {
+    size_t quads = blocks >> 2;
+    size_t rest = blocks & 3;
+    __asm__ volatile ("movd %[p], %%xmm0\n\t"
+                      "pshufd $0, %%xmm0, %%xmm0\n\t"
+                      "test %[q], %[q]\n\t"
+                      "jz 2f\n"
+                      "1:\n\t"
+                      "movntdq %%xmm0, (%[d])\n\t"
+                      "movntdq %%xmm0, 16(%[d])\n\t"
+                      "movntdq %%xmm0, 32(%[d])\n\t"
+                      "movntdq %%xmm0, 48(%[d])\n\t"
+                      "add $64, %[d]\n\t"
+                      "dec %[q]\n\t"
+                      "jnz 1b\n"
+                      "2:\n\t"
+                      "test %[r], %[r]\n\t"
+                      "jz 4f\n"
+                      "3:\n\t"
+                      "movntdq %%xmm0, (%[d])\n\t"
+                      "add $16, %[d]\n\t"
+                      "dec %[r]\n\t"
+                      "jnz 3b\n"
+                      "4:\n\t"
+                      "sfence"
+                      : [d] "+r"(d), [q] "+r"(quads), [r] "+r"(rest)
+                      : [p] "r"(pattern)
+                      : MEM_XMM_CLOBBERS "memory");
+    return d;
+}
+
+// Copy 'blocks' 16-byte blocks; d is 16-byte aligned, s may be unaligned
+static inline void mem_stream_copy16(uint8_t* d, const uint8_t* s, size_t blocks) {
+    size_t quads = blocks >> 2;
+    size_t rest = blocks & 3;
+    __asm__ volatile ("test %[q], %[q]\n\t"
+                      "jz 2f\n"
+                      "1:\n\t"
+                      "movdqu (%[s]), %%xmm0\n\t"
+                      "movdqu 16(%[s]), %%xmm1\n\t"
+                      "movdqu 32(%[s]), %%xmm2\n\t"
+                      "movdqu 48(%[s]), %%xmm3\n\t"
+                      "movntdq %%xmm0, (%[d])\n\t"
+                      "movntdq %%xmm1, 16(%[d])\n\t"
+                      "movntdq %%xmm2, 32(%[d])\n\t"
+                      "movntdq %%xmm3, 48(%[d])\n\t"
+                      "add $64, %[s]\n\t"
+                      "add $64, %[d]\n\t"
+                      "dec %[q]\n\t"
+                      "jnz 1b\n"
+                      "2:\n\t"
+                      "test %[r], %[r]\n\t"
+                      "jz 4f\n"
+                      "3:\n\t"
+                      "movdqu (%[s]), %%xmm0\n\t"
+                      "movntdq %%xmm0, (%[d])\n\t"
+                      "add $16, %[s]\n\t"
+                      "add $16, %[d]\n\t"
+                      "dec %[r]\n\t"
+                      "jnz 3b\n"
+                      "4:\n\t"
+                      "sfence"
+                      : [d] "+r"(d), [s] "+r"(s), [q] "+r"(quads), [r] "+r"(rest)
+                      :
+                      : MEM_XMM_CLOBBERS "memory");
+}
+
+// Byte fill: integer head up to 16-byte alignment, streamed body, tail
+static inline void mem_fill_stream(void* dest, uint8_t c, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    size_t head = (16 - ((size_t)d & 15)) & 15;
+
+    if (n < MEM_STREAM_MIN_SIZE) {
+        mem_fill(d, c, n);
+        return;
+    }
+
+    mem_fill_bytes(d, c, head);
+    n -= head;
+    d = mem_stream_fill16(d + head, c * 0x01010101u, n >> 4);
+    mem_fill_bytes(d, c, n & 15);
+}
+
+// Dword fill of 'count' values; dest must be 4-byte aligned so the
+// pattern stays in phase
+static inline void mem_fill32_stream(void* dest, uint32_t value, size_t count) {
+    uint32_t* d = (uint32_t*)dest;
+    size_t head = ((16 - ((size_t)d & 15)) & 15) >> 2;
+
+    if (count * 4 < MEM_STREAM_MIN_SIZE) {
+        mem_fill32(d, value, count);
+        return;
+    }
+
+    mem_fill32(d, value, head);
+    count -= head;
+    d = (uint32_t*)mem_stream_fill16((uint8_t*)(d + head), value, count >> 2);
+    mem_fill32(d, value, count & 3);
+}
+
+static inline void mem_copy_stream(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    size_t head = (16 - ((size_t)d & 15)) & 15;
+
+    if (n < MEM_STREAM_MIN_SIZE) {
+        mem_copy(d, s, n);
+        return;
+    }
+
+    mem_copy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    mem_stream_copy16(d, s, n >> 4);
+    mem_copy(d + (n & ~15), s + (n & ~15), n & 15);
+}
+#endif // USE_SSE2
+
+#endif // MEMOPS_H
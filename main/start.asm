@@ -6,10 +6,20 @@
 [BITS 32]
 [GLOBAL _start]
 [EXTERN kernel_main]
+[EXTERN __kernel_sectors]
+
+BOOT_TSC_BSS    equ 0x708 + 32
 
 section .text.entry
 
 _start:
+    jmp short entry
+    
+    ; Image header, read by the bootloader: image size in 512-byte sectors
+    align 4, db 0
+    dd __kernel_sectors
+
+entry:
     ; Setup segments (already done by bootloader, but make sure)
     mov ax, 0x10
     mov ds, ax
@@ -28,7 +38,13 @@ _start:
     xor eax, eax
     rep stosb
     
-    ; Call C kernel_main
+    ; Boot timeline stamp in BootInfo.tsc[BOOT_TSC_BSS]
+    rdtsc
+    mov [ebx + BOOT_TSC_BSS], eax
+    mov [ebx + BOOT_TSC_BSS + 4], edx
+    
+    ; Call C kernel_main(boot_info) - EBX survives the BSS clear
+    push ebx
     call kernel_main
     
     ; If kernel_main returns, halt
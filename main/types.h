@@ -21,4 +21,10 @@ typedef unsigned int size_t;
 
 #define NULL  ((void*)0)
 
+// Variable arguments (compiler builtins, there is no <stdarg.h>)
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type)   __builtin_va_arg(ap, type)
+#define va_end(ap)         __builtin_va_end(ap)
+
 #endif // TYPES_H
\ No newline at end of file
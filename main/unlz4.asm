@@ -0,0 +1,91 @@
+; ========================================
+; UNLZ4.ASM - Decompressor stub for the packed kernel image
+; The bootloader loads stub + LZ4 payload at 0x10000 like a plain
+; kernel. The stub moves itself and the payload to 1 MB, unpacks the
+; kernel to 0x10000 and jumps to its _start with EBX intact.
+; lz4pack fills in the header and appends the payload.
+; ========================================
+
+[BITS 32]
+[ORG 0x100000]
+
+KERNEL_ADDRESS  equ 0x10000
+BOOT_TSC_UNPACKED equ 0x708 + 24        ; BootInfo offset of tsc[BOOT_TSC_UNPACKED]
+
+start:
+    jmp short entry
+
+    ; Image header, same layout as start.asm: image size in sectors
+    align 4, db 0
+image_sectors:  dd 0
+payload_size:   dd 0                    ; LZ4 block bytes after the stub
+
+entry:
+    ; Still running from the load address - copy up, continue there
+    cld
+    mov esi, KERNEL_ADDRESS
+    mov edi, start
+    mov ecx, [KERNEL_ADDRESS + payload_size - start]
+    add ecx, payload - start
+    rep movsb
+    mov eax, relocated
+    jmp eax
+
+relocated:
+    push ebx                            ; Boot info for kernel_main
+    mov esi, payload
+    mov edx, esi
+    add edx, [payload_size]
+    mov edi, KERNEL_ADDRESS
+
+; ========================================
+; LZ4 BLOCK DECODER
+; ESI = input, EDX = input end, EDI = output. Each sequence is a token
+; (literal count : match length - 4), the literals, a 16-bit back
+; offset and the match; the last sequence stops after its literals.
+; ========================================
+.sequence:
+    movzx ebx, byte [esi]               ; Token
+    inc esi
+    mov ecx, ebx
+    shr ecx, 4
+    call .length
+    rep movsb                           ; Literals
+    cmp esi, edx
+    jae .done
+
+    movzx ebp, word [esi]               ; Match offset
+    add esi, 2
+    mov ecx, ebx
+    and ecx, 15
+    call .length
+    add ecx, 4
+    push esi
+    mov esi, edi
+    sub esi, ebp
+    rep movsb                           ; Bytewise, so overlapping runs repeat
+    pop esi
+    jmp .sequence
+
+; A 4-bit length of 15 continues in the following bytes, each added
+; until one is below 255
+.length:
+    cmp ecx, 15
+    jne .length_done
+.length_byte:
+    movzx eax, byte [esi]
+    inc esi
+    add ecx, eax
+    cmp al, 255
+    je .length_byte
+.length_done:
+    ret
+
+.done:
+    pop ebx
+    rdtsc
+    mov [ebx + BOOT_TSC_UNPACKED], eax
+    mov [ebx + BOOT_TSC_UNPACKED + 4], edx
+    jmp KERNEL_ADDRESS
+
+payload: